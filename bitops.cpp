@@ -0,0 +1,356 @@
+#include <string.h>
+#include "bitops.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BITOPS_AVX2 1
+#elif defined(__aarch64__)
+// AArch64 only: find_neon() needs the across-vector vminvq_u8, which 32-bit
+// ARM does not have; it builds the scalar kernels
+#include <arm_neon.h>
+#define BITOPS_NEON 1
+#endif
+
+static bool g_force_scalar = false;
+
+/*
+//////////////////////////////////
+SCALAR KERNELS
+//////////////////////////////////
+*/
+
+// IN : const uint8_t *p
+// OUT : 8 bytes at p
+// DESC: Unaligned 64-bit load
+static uint64_t load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// IN : const uint8_t *p, size_t n
+// OUT : number of set bits
+// DESC: Popcount 32 bytes per iteration, then the tail
+static size_t count_scalar(const uint8_t *p, size_t n)
+{
+    size_t total = 0;
+    size_t i = 0;
+    for( ; i + 32 <= n ; i += 32)
+    {
+        total += __builtin_popcountll(load64(p + i))
+               + __builtin_popcountll(load64(p + i + 8))
+               + __builtin_popcountll(load64(p + i + 16))
+               + __builtin_popcountll(load64(p + i + 24));
+    }
+    for( ; i + 8 <= n ; i += 8)
+    {
+        total += __builtin_popcountll(load64(p + i));
+    }
+    for( ; i < n ; ++i)
+    {
+        total += __builtin_popcount(p[i]);
+    }
+    return total;
+}
+
+// IN : int op, uint8_t *dst, const uint8_t *src, size_t n
+// OUT : dst combined with src
+// DESC: Bitwise op 8 bytes at a time
+static void op_scalar(int op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for( ; i + 8 <= n ; i += 8)
+    {
+        uint64_t a = load64(dst + i);
+        uint64_t b = load64(src + i);
+        uint64_t r = op == BIT_AND ? (a & b) : op == BIT_OR ? (a | b)
+                   : op == BIT_XOR ? (a ^ b) : ~b;
+        memcpy(dst + i, &r, 8);
+    }
+    for( ; i < n ; ++i)
+    {
+        uint8_t a = dst[i];
+        uint8_t b = src[i];
+        dst[i] = op == BIT_AND ? (a & b) : op == BIT_OR ? (a | b)
+               : op == BIT_XOR ? (a ^ b) : (uint8_t)~b;
+    }
+}
+
+// IN : const uint8_t *p, size_t from, size_t n, int bit
+// OUT : bit index of the first bit equal to bit at or after byte from, or -1
+// DESC: Skip 8 bytes at a time that cannot hold the bit, then scan bytes
+static int64_t find_scalar(const uint8_t *p, size_t from, size_t n, int bit)
+{
+    uint64_t skip64 = bit ? 0 : ~(uint64_t)0;
+    uint8_t skip8 = bit ? 0 : 0xFF;
+    size_t i = from;
+    while(i + 8 <= n && load64(p + i) == skip64)
+    {
+        i += 8;
+    }
+    for( ; i < n ; ++i)
+    {
+        if(p[i] == skip8) continue;
+        uint8_t v = bit ? p[i] : (uint8_t)~p[i];
+        return (int64_t)(i * 8 + (size_t)__builtin_clz((unsigned)v << 24));
+    }
+    return -1;
+}
+
+/*
+//////////////////////////////////
+AVX2 KERNELS
+//////////////////////////////////
+*/
+
+#if BITOPS_AVX2
+
+// IN : none
+// OUT : true if the CPU supports AVX2
+// DESC: Checked once
+static bool has_avx2()
+{
+    static int cached = -1;
+    if(cached < 0)
+    {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return cached == 1;
+}
+
+// IN : __m256i v
+// OUT : per 64-bit lane popcount of v, summed into 4 lanes
+// DESC: Nibble lookup with vpshufb, then vpsadbw to add the 8 bytes of a lane
+__attribute__((target("avx2")))
+static __m256i popcnt256(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+// IN : const uint8_t *p, size_t n
+// OUT : number of set bits
+// DESC: 64 bytes per iteration; byte counts of two vectors (max 16 per byte)
+//       are added before the horizontal sum
+__attribute__((target("avx2")))
+static size_t count_avx2(const uint8_t *p, size_t n)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for( ; i + 64 <= n ; i += 64)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        __m256i ca = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(a, low)),
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(a, 4), low)));
+        __m256i cb = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(b, low)),
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), low)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(ca, cb), _mm256_setzero_si256()));
+    }
+    for( ; i + 32 <= n ; i += 32)
+    {
+        acc = _mm256_add_epi64(acc, popcnt256(_mm256_loadu_si256((const __m256i *)(p + i))));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + count_scalar(p + i, n - i);
+}
+
+// IN : int op, uint8_t *dst, const uint8_t *src, size_t n
+// OUT : dst combined with src
+// DESC: Bitwise op 64 bytes per iteration
+__attribute__((target("avx2")))
+static void op_avx2(int op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m256i ones = _mm256_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for( ; i + 64 <= n ; i += 64)
+    {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        switch(op)
+        {
+        case BIT_AND: a0 = _mm256_and_si256(a0, b0); a1 = _mm256_and_si256(a1, b1); break;
+        case BIT_OR:  a0 = _mm256_or_si256(a0, b0);  a1 = _mm256_or_si256(a1, b1);  break;
+        case BIT_XOR: a0 = _mm256_xor_si256(a0, b0); a1 = _mm256_xor_si256(a1, b1); break;
+        default:      a0 = _mm256_xor_si256(b0, ones); a1 = _mm256_xor_si256(b1, ones); break;
+        }
+        _mm256_storeu_si256((__m256i *)(dst + i), a0);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), a1);
+    }
+    op_scalar(op, dst + i, src + i, n - i);
+}
+
+// IN : const uint8_t *p, size_t n, int bit
+// OUT : bit index of the first bit equal to bit, or -1
+// DESC: Skip 32-byte blocks that are all 0x00 (bit 1) or all 0xFF (bit 0)
+__attribute__((target("avx2")))
+static int64_t find_avx2(const uint8_t *p, size_t n, int bit)
+{
+    const __m256i skip = bit ? _mm256_setzero_si256() : _mm256_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for( ; i + 32 <= n ; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        if((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, skip)) != 0xFFFFFFFFu) break;
+    }
+    return find_scalar(p, i, n, bit);
+}
+
+#endif
+
+/*
+//////////////////////////////////
+NEON KERNELS
+//////////////////////////////////
+*/
+
+#if BITOPS_NEON
+
+// IN : const uint8_t *p, size_t n
+// OUT : number of set bits
+// DESC: vcnt per byte, widened and accumulated in 16-bit lanes; the lanes
+//       are folded into 64 bits every 2048 bytes, before they can overflow
+static size_t count_neon(const uint8_t *p, size_t n)
+{
+    uint64x2_t total = vdupq_n_u64(0);
+    size_t i = 0;
+    while(i + 64 <= n)
+    {
+        uint16x8_t acc = vdupq_n_u16(0);
+        size_t stop = i + 2048 < n ? i + 2048 : n;
+        for( ; i + 64 <= stop ; i += 64)
+        {
+            uint8x16_t c0 = vcntq_u8(vld1q_u8(p + i));
+            uint8x16_t c1 = vcntq_u8(vld1q_u8(p + i + 16));
+            uint8x16_t c2 = vcntq_u8(vld1q_u8(p + i + 32));
+            uint8x16_t c3 = vcntq_u8(vld1q_u8(p + i + 48));
+            acc = vpadalq_u8(acc, vaddq_u8(vaddq_u8(c0, c1), vaddq_u8(c2, c3)));
+        }
+        total = vpadalq_u32(total, vpaddlq_u16(acc));
+    }
+    return (size_t)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1)) + count_scalar(p + i, n - i);
+}
+
+// IN : int op, uint8_t *dst, const uint8_t *src, size_t n
+// OUT : dst combined with src
+// DESC: Bitwise op 32 bytes per iteration
+static void op_neon(int op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+    for( ; i + 32 <= n ; i += 32)
+    {
+        uint8x16_t a0 = vld1q_u8(dst + i);
+        uint8x16_t a1 = vld1q_u8(dst + i + 16);
+        uint8x16_t b0 = vld1q_u8(src + i);
+        uint8x16_t b1 = vld1q_u8(src + i + 16);
+        switch(op)
+        {
+        case BIT_AND: a0 = vandq_u8(a0, b0); a1 = vandq_u8(a1, b1); break;
+        case BIT_OR:  a0 = vorrq_u8(a0, b0); a1 = vorrq_u8(a1, b1); break;
+        case BIT_XOR: a0 = veorq_u8(a0, b0); a1 = veorq_u8(a1, b1); break;
+        default:      a0 = vmvnq_u8(b0);     a1 = vmvnq_u8(b1);     break;
+        }
+        vst1q_u8(dst + i, a0);
+        vst1q_u8(dst + i + 16, a1);
+    }
+    op_scalar(op, dst + i, src + i, n - i);
+}
+
+// IN : const uint8_t *p, size_t n, int bit
+// OUT : bit index of the first bit equal to bit, or -1
+// DESC: Skip 16-byte blocks that are all 0x00 (bit 1) or all 0xFF (bit 0)
+static int64_t find_neon(const uint8_t *p, size_t n, int bit)
+{
+    uint8x16_t skip = vdupq_n_u8(bit ? 0 : 0xFF);
+    size_t i = 0;
+    for( ; i + 16 <= n ; i += 16)
+    {
+        // all lanes equal to skip <=> min of the comparison is 0xFF
+        if(vminvq_u8(vceqq_u8(vld1q_u8(p + i), skip)) != 0xFF) break;
+    }
+    return find_scalar(p, i, n, bit);
+}
+
+#endif
+
+/*
+//////////////////////////////////
+DISPATCH
+//////////////////////////////////
+*/
+
+// IN : const uint8_t *p, size_t n
+// OUT : number of set bits
+// DESC: Popcount of a byte range
+size_t bit_count(const uint8_t *p, size_t n)
+{
+#if BITOPS_AVX2
+    if(!g_force_scalar && has_avx2()) return count_avx2(p, n);
+#elif BITOPS_NEON
+    if(!g_force_scalar) return count_neon(p, n);
+#endif
+    return count_scalar(p, n);
+}
+
+// IN : int op, uint8_t *dst, const uint8_t *src, size_t n
+// OUT : dst combined with src
+// DESC: In place bitwise AND / OR / XOR, or NOT of src
+void bit_op(int op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+#if BITOPS_AVX2
+    if(!g_force_scalar && has_avx2()) return op_avx2(op, dst, src, n);
+#elif BITOPS_NEON
+    if(!g_force_scalar) return op_neon(op, dst, src, n);
+#endif
+    op_scalar(op, dst, src, n);
+}
+
+// IN : const uint8_t *p, size_t n, int bit
+// OUT : bit index of the first bit equal to bit, or -1
+// DESC: Find the first set (bit 1) or clear (bit 0) bit
+int64_t bit_find(const uint8_t *p, size_t n, int bit)
+{
+#if BITOPS_AVX2
+    if(!g_force_scalar && has_avx2()) return find_avx2(p, n, bit);
+#elif BITOPS_NEON
+    if(!g_force_scalar) return find_neon(p, n, bit);
+#endif
+    return find_scalar(p, 0, n, bit);
+}
+
+// IN : none
+// OUT : name of the kernels in use
+// DESC: For stats and benchmarks
+const char *bitops_backend()
+{
+#if BITOPS_AVX2
+    if(!g_force_scalar && has_avx2()) return "avx2";
+#elif BITOPS_NEON
+    if(!g_force_scalar) return "neon";
+#endif
+    return "scalar";
+}
+
+// IN : bool on
+// OUT : none
+// DESC: Select the scalar kernels regardless of the CPU
+void bitops_force_scalar(bool on)
+{
+    g_force_scalar = on;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Bitmap kernels over byte strings. Bit 0 is the most significant bit of
+// byte 0, so offsets read left to right in the string.
+// x86-64 uses AVX2 when the CPU has it (checked at runtime), AArch64 uses
+// NEON, everything else (32-bit ARM included) a 64-bit scalar loop.
+
+enum
+{
+    BIT_AND = 0,
+    BIT_OR  = 1,
+    BIT_XOR = 2,
+    BIT_NOT = 3,
+};
+
+// Number of set bits in n bytes.
+size_t  bit_count(const uint8_t *p, size_t n);
+
+// dst[i] = dst[i] op src[i] for n bytes; BIT_NOT ignores dst: dst[i] = ~src[i].
+void    bit_op(int op, uint8_t *dst, const uint8_t *src, size_t n);
+
+// Bit index of the first bit equal to bit (0 or 1) in n bytes, or -1.
+int64_t bit_find(const uint8_t *p, size_t n, int bit);
+
+// Name of the kernels in use: "avx2", "neon" or "scalar".
+const char *bitops_backend();
+
+// Use the scalar kernels even if SIMD is available (for benchmarks).
+void    bitops_force_scalar(bool on);
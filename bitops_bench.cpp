@@ -0,0 +1,111 @@
+// Bitmap kernel throughput, SIMD vs scalar, in GB/s of bitmap processed.
+//
+//   bitops_bench [--min-bytes N] [--max-bytes N]
+//
+// count : bit_count() over the buffer
+// and   : bit_op(BIT_AND) of two buffers, in place (xor/or/not run the same loop)
+// find  : bit_find() of a 1 in a buffer of zeros, the worst case
+// Each result is checked against the scalar kernels.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "bitops.h"
+
+static double now_sec()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// repeat fn over n bytes until ~1 GB was processed, return GB/s
+template <class F>
+static double gbps(size_t n, F fn)
+{
+    size_t rounds = (1ull << 30) / n;
+    if(rounds == 0) rounds = 1;
+    fn();   // warm up
+    double t0 = now_sec();
+    for(size_t i = 0 ; i < rounds ; ++i)
+    {
+        fn();
+    }
+    return (double)n * rounds / (now_sec() - t0) / 1e9;
+}
+
+static void check(bool ok, const char *what, size_t n)
+{
+    if(!ok)
+    {
+        fprintf(stderr, "%s: SIMD and scalar results differ at %zu bytes\n", what, n);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t min_bytes = 4 << 10;
+    size_t max_bytes = 64 << 20;
+    for(int i = 1 ; i + 1 < argc ; i += 2)
+    {
+        if(!strcmp(argv[i], "--min-bytes")) min_bytes = strtoull(argv[i + 1], NULL, 10);
+        else if(!strcmp(argv[i], "--max-bytes")) max_bytes = strtoull(argv[i + 1], NULL, 10);
+    }
+
+    std::vector<uint8_t> a(max_bytes + 7);
+    std::vector<uint8_t> b(max_bytes + 7);
+    std::vector<uint8_t> zeros(max_bytes + 7, 0);
+    uint64_t x = 88172645463325252ull;
+    for(size_t i = 0 ; i < a.size() ; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        a[i] = (uint8_t)x;
+        b[i] = (uint8_t)(x >> 8);
+    }
+
+    const char *simd = bitops_backend();
+    printf("kernels: %s\n", simd);
+    printf("%10s %6s %10s %10s %8s\n", "bytes", "kernel", "scalar", simd, "speedup");
+
+    // odd sizes keep the tail loops honest
+    for(size_t n = min_bytes ; n <= max_bytes ; n *= 4)
+    {
+        size_t m = n + 7;
+        volatile size_t sink = 0;
+
+        bitops_force_scalar(true);
+        size_t count_ref = bit_count(a.data(), m);
+        int64_t find_ref = bit_find(zeros.data(), m, 1);
+        std::vector<uint8_t> and_ref(a.begin(), a.begin() + m);
+        bit_op(BIT_AND, and_ref.data(), b.data(), m);
+
+        bitops_force_scalar(false);
+        check(bit_count(a.data(), m) == count_ref, "count", m);
+        check(bit_find(zeros.data(), m, 1) == find_ref, "find", m);
+        std::vector<uint8_t> dst(a.begin(), a.begin() + m);
+        bit_op(BIT_AND, dst.data(), b.data(), m);
+        check(dst == and_ref, "and", m);
+
+        double speed[2][3];
+        for(int simd_on = 0 ; simd_on < 2 ; ++simd_on)
+        {
+            bitops_force_scalar(!simd_on);
+            speed[simd_on][0] = gbps(m, [&]() { sink = sink + bit_count(a.data(), m); });
+            speed[simd_on][1] = gbps(m, [&]() { bit_op(BIT_AND, dst.data(), b.data(), m); });
+            speed[simd_on][2] = gbps(m, [&]() { sink = sink + (size_t)bit_find(zeros.data(), m, 1); });
+        }
+        bitops_force_scalar(false);
+
+        const char *names[3] = {"count", "and", "find"};
+        for(int k = 0 ; k < 3 ; ++k)
+        {
+            printf("%10zu %6s %7.1f GB/s %7.1f GB/s %7.1fx\n", m, names[k],
+                   speed[0][k], speed[1][k], speed[1][k] / speed[0][k]);
+        }
+        (void)sink;
+    }
+    return 0;
+}
@@ -1,15 +1,12 @@
-#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/ip.h>
 #include <string>
 #include <vector>
+#include "client_lib.h"
 
 
 static void msg(const char *msg) {
@@ -22,125 +19,36 @@ static void die(const char *msg) {
     abort();
 }
 
-static int32_t read_full(int fd, char *buf, size_t n) {
-    while (n > 0) {
-        ssize_t rv = read(fd, buf, n);
-        if (rv <= 0) {
-            return -1;  // error, or unexpected EOF
-        }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
-    }
-    return 0;
-}
-
-static int32_t write_all(int fd, const char *buf, size_t n) {
-    while (n > 0) {
-        ssize_t rv = write(fd, buf, n);
-        if (rv <= 0) {
-            return -1;  // error
-        }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
-    }
-    return 0;
-}
-
-const size_t k_max_msg = 4096;
-
-static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
-    uint32_t len = 4;
-    for (const std::string &s : cmd) {
-        len += 4 + s.size();
-    }
-    if (len > k_max_msg) {
-        return -1;
-    }
-
-    char wbuf[4 + k_max_msg];
-    memcpy(&wbuf[0], &len, 4);  // assume little endian
-    uint32_t n = cmd.size();
-    memcpy(&wbuf[4], &n, 4);
-    size_t cur = 8;
-    for (const std::string &s : cmd) {
-        uint32_t p = (uint32_t)s.size();
-        memcpy(&wbuf[cur], &p, 4);
-        memcpy(&wbuf[cur + 4], s.data(), s.size());
-        cur += 4 + s.size();
-    }
-    return write_all(fd, wbuf, 4 + len);
-}
-
-static int32_t read_res(int fd) {
-    // 4 bytes header
-    char rbuf[4 + k_max_msg];
-    errno = 0;
-    int32_t err = read_full(fd, rbuf, 4);
-    if (err) {
-        if (errno == 0) {
-            msg("EOF");
-        } else {
-            msg("read() error");
-        }
-        return err;
-    }
-
-    uint32_t len = 0;
-    memcpy(&len, rbuf, 4);  // assume little endian
-    if (len > k_max_msg) {
-        msg("too long");
-        return -1;
-    }
-
-    // reply body
-    err = read_full(fd, &rbuf[4], len);
-    if (err) {
-        msg("read() error");
-        return err;
-    }
-
-    // print the result
-    uint32_t rescode = 0;
-    if (len < 4) {
-        msg("bad response");
-        return -1;
-    }
-    memcpy(&rescode, &rbuf[4], 4);
-    printf("server says: [%u] %.*s\n", rescode, len - 4, &rbuf[8]);
-    return 0;
-}
-
 int main(int argc, char **argv) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    uint16_t port = 8080;
+    const char *unix_path = NULL;
+    int argi = 1;
+    if (argc > 2 && strcmp(argv[1], "--port") == 0) {
+        port = (uint16_t)atoi(argv[2]);
+        argi = 3;
+    } else if (argc > 2 && strcmp(argv[1], "--unixsocket") == 0) {
+        unix_path = argv[2];
+        argi = 3;
+    }
+
+    int fd = unix_path ? unix_connect(unix_path) : tcp_connect("127.0.0.1", port);
     if (fd < 0) {
-        die("socket()");
-    }
-
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(8080);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);  // 127.0.0.1
-    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-    if (rv) {
         die("connect");
     }
 
     std::vector<std::string> cmd;
-    for (int i = 1; i < argc; ++i) {
+    for (int i = argi; i < argc; ++i) {
         cmd.push_back(argv[i]);
     }
-    int32_t err = send_req(fd, cmd);
-    if (err) {
-        goto L_DONE;
-    }
-    err = read_res(fd);
-    if (err) {
+
+    Reply reply;
+    if (send_req(fd, cmd) || read_res(fd, reply)) {
+        msg("request failed");
         goto L_DONE;
     }
+    printf("server says: [%u] %.*s\n", reply.status, (int)reply.data.size(), reply.data.data());
 
 L_DONE:
     close(fd);
     return 0;
-}
\ No newline at end of file
+}
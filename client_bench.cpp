@@ -0,0 +1,256 @@
+// Throughput benchmark: request/response lockstep vs the pipelined client.
+//
+//   client_bench [--port N] [--requests N] [--depth D] [--threads T] [--pool P]
+//                [--unixsocket PATH] [--latency-only]
+//
+// lockstep  : one blocking socket, send_req() then read_res() per request
+// pipelined : one Connection, D requests in flight as futures
+// pool      : T threads, each waiting on its own request, sharing a pool of
+//             P connections; concurrent requests are batched into one write
+// latency   : round-trip percentiles of lockstep requests over loopback TCP,
+//             and over the Unix domain socket when --unixsocket is given
+// nearcache : reads of 1000 hot keys through one Connection, without and
+//             with a NearCache, while another connection keeps updating them
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "client_lib.h"
+
+
+static double now_sec()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<std::string> make_cmd(size_t i)
+{
+    std::string key = "bench:" + std::to_string(i % 10000);
+    if(i % 2)
+    {
+        return {"get", key};
+    }
+    return {"set", key, "value-" + std::to_string(i)};
+}
+
+static void report(const char *name, size_t n, double secs)
+{
+    printf("%-10s %8zu requests  %7.3f s  %10.0f req/s\n", name, n, secs, n / secs);
+}
+
+static void bench_lockstep(uint16_t port, size_t n)
+{
+    int fd = tcp_connect("127.0.0.1", port);
+    if(fd < 0)
+    {
+        fprintf(stderr, "connect failed\n");
+        exit(1);
+    }
+
+    double t0 = now_sec();
+    Reply reply;
+    for(size_t i = 0 ; i < n ; ++i)
+    {
+        if(send_req(fd, make_cmd(i)) || read_res(fd, reply))
+        {
+            fprintf(stderr, "request failed\n");
+            exit(1);
+        }
+    }
+    report("lockstep", n, now_sec() - t0);
+    close(fd);
+}
+
+static void bench_latency(const char *name, int fd, size_t n)
+{
+    if(fd < 0)
+    {
+        fprintf(stderr, "connect failed\n");
+        exit(1);
+    }
+
+    std::vector<double> lat(n);
+    Reply reply;
+    double start = now_sec();
+    for(size_t i = 0 ; i < n ; ++i)
+    {
+        double t0 = now_sec();
+        if(send_req(fd, make_cmd(i)) || read_res(fd, reply))
+        {
+            fprintf(stderr, "request failed\n");
+            exit(1);
+        }
+        lat[i] = (now_sec() - t0) * 1e6;
+    }
+    double secs = now_sec() - start;
+    close(fd);
+
+    std::sort(lat.begin(), lat.end());
+    printf("%-10s p50 %6.1f us  p99 %6.1f us  p99.9 %6.1f us  %10.0f req/s\n", name,
+           lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000], n / secs);
+}
+
+static void bench_pipelined(uint16_t port, size_t n, size_t depth)
+{
+    Connection conn("127.0.0.1", port);
+    if(!conn.connect())
+    {
+        fprintf(stderr, "connect failed\n");
+        exit(1);
+    }
+
+    double t0 = now_sec();
+    std::vector<std::future<Reply>> window;
+    for(size_t i = 0 ; i < n ; i += depth)
+    {
+        window.clear();
+        for(size_t j = i ; j < n && j < i + depth ; ++j)
+        {
+            window.push_back(conn.send(make_cmd(j)));
+        }
+        for(std::future<Reply> &f : window)
+        {
+            if(f.get().status == RES_IO)
+            {
+                fprintf(stderr, "request failed\n");
+                exit(1);
+            }
+        }
+    }
+    report("pipelined", n, now_sec() - t0);
+}
+
+static void bench_pool(uint16_t port, size_t n, size_t threads, size_t pool_size)
+{
+    ConnPool pool("127.0.0.1", port, pool_size);
+
+    double t0 = now_sec();
+    std::vector<std::thread> workers;
+    for(size_t t = 0 ; t < threads ; ++t)
+    {
+        workers.emplace_back([&pool, n, threads, t]() {
+            for(size_t i = t ; i < n ; i += threads)
+            {
+                if(pool.send(make_cmd(i)).get().status == RES_IO)
+                {
+                    fprintf(stderr, "request failed\n");
+                    exit(1);
+                }
+            }
+        });
+    }
+    for(std::thread &w : workers)
+    {
+        w.join();
+    }
+    report("pool", n, now_sec() - t0);
+}
+
+static void bench_near_cache(uint16_t port, size_t n)
+{
+    const size_t nkeys = 1000;
+    Connection writer("127.0.0.1", port);
+    Connection plain("127.0.0.1", port);
+    Connection cached("127.0.0.1", port);
+    if(!writer.connect() || !plain.connect() || !cached.connect())
+    {
+        fprintf(stderr, "connect failed\n");
+        exit(1);
+    }
+    for(size_t i = 0 ; i < nkeys ; ++i)
+    {
+        writer.send({"set", "hot:" + std::to_string(i), "value-" + std::to_string(i)});
+    }
+    writer.send({"ping"}).get();
+
+    // ~1000 updates per second to random hot keys
+    std::atomic<bool> stop{false};
+    std::thread updates([&]() {
+        for(size_t i = 0 ; !stop ; ++i)
+        {
+            writer.send({"set", "hot:" + std::to_string(i * 7919 % nkeys), std::to_string(i)}).get();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    double t0 = now_sec();
+    for(size_t i = 0 ; i < n ; ++i)
+    {
+        if(plain.send({"get", "hot:" + std::to_string(i % nkeys)}).get().status != RES_OK)
+        {
+            fprintf(stderr, "request failed\n");
+            exit(1);
+        }
+    }
+    report("no cache", n, now_sec() - t0);
+
+    NearCache cache(cached, nkeys);
+    if(!cache.start())
+    {
+        fprintf(stderr, "tracking failed\n");
+        exit(1);
+    }
+    t0 = now_sec();
+    for(size_t i = 0 ; i < n ; ++i)
+    {
+        if(cache.get("hot:" + std::to_string(i % nkeys)).status != RES_OK)
+        {
+            fprintf(stderr, "request failed\n");
+            exit(1);
+        }
+    }
+    report("nearcache", n, now_sec() - t0);
+    printf("           hit rate %.2f%%, %llu invalidations\n",
+           100.0 * cache.hits() / n, (unsigned long long)cache.invalidations());
+
+    stop = true;
+    updates.join();
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t port = 8080;
+    size_t n = 200000;
+    size_t depth = 128;
+    size_t threads = 16;
+    size_t pool_size = 2;
+    const char *unix_path = NULL;
+    bool latency_only = false;
+    for(int i = 1 ; i < argc ; i += 2)
+    {
+        if(!strcmp(argv[i], "--latency-only"))
+        {
+            latency_only = true;
+            i--;
+            continue;
+        }
+        if(i + 1 >= argc) break;
+        if(!strcmp(argv[i], "--port")) port = (uint16_t)atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--unixsocket")) unix_path = argv[i + 1];
+        else if(!strcmp(argv[i], "--requests")) n = strtoull(argv[i + 1], NULL, 10);
+        else if(!strcmp(argv[i], "--depth")) depth = strtoull(argv[i + 1], NULL, 10);
+        else if(!strcmp(argv[i], "--threads")) threads = strtoull(argv[i + 1], NULL, 10);
+        else if(!strcmp(argv[i], "--pool")) pool_size = strtoull(argv[i + 1], NULL, 10);
+    }
+
+    if(!latency_only)
+    {
+        bench_lockstep(port, n);
+        bench_pipelined(port, n, depth);
+        bench_pool(port, n, threads, pool_size);
+        bench_near_cache(port, n);
+    }
+    bench_latency("tcp", tcp_connect("127.0.0.1", port), n);
+    if(unix_path)
+    {
+        bench_latency("unix", unix_connect(unix_path), n);
+    }
+    return 0;
+}
@@ -0,0 +1,958 @@
+// stdlib
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+// system
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+// Project Lib
+#include "client_lib.h"
+#include "cluster.h"
+
+const int k_max_redirects = 5;
+
+/*
+//////////////////////////////////
+BLOCKING HELPERS
+//////////////////////////////////
+*/
+
+// IN : int fd, char *buf, size_t n
+// OUT : returns 0 once n bytes are read, -1 on error or EOF
+// DESC: Read exactly n bytes from a blocking socket
+static int32_t read_full(int fd, char *buf, size_t n)
+{
+    while(n > 0)
+    {
+        ssize_t rv = read(fd, buf, n);
+        if(rv <= 0)
+        {
+            return -1;  // error, or unexpected EOF
+        }
+        assert((size_t)rv <= n);
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+// IN : int fd, const char *buf, size_t n
+// OUT : returns 0 once n bytes are written, -1 on error
+// DESC: Write exactly n bytes to a blocking socket
+static int32_t write_all(int fd, const char *buf, size_t n)
+{
+    while(n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if(rv <= 0)
+        {
+            return -1;  // error
+        }
+        assert((size_t)rv <= n);
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+// IN : const char *host, uint16_t port
+// OUT : connected blocking socket, or -1
+// DESC: Connect to an IPv4 host:port with Nagle disabled
+int tcp_connect(const char *host, uint16_t port)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(::connect(fd, (const struct sockaddr *)&addr, sizeof(addr)))
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    return fd;
+}
+
+// IN : const char *path
+// OUT : connected blocking socket, or -1
+// DESC: Connect to a Unix domain socket
+int unix_connect(const char *path)
+{
+    struct sockaddr_un addr = {};
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(::connect(fd, (const struct sockaddr *)&addr, sizeof(addr)))
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// IN : std::vector<uint8_t> &out, const std::vector<std::string> &cmd
+// OUT : out is appended with the request message
+// DESC: Serialize a command: len | nstr | (len | str)*, little endian
+void encode_req(std::vector<uint8_t> &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for(const std::string &s : cmd)
+    {
+        len += 4 + (uint32_t)s.size();
+    }
+
+    size_t cur = out.size();
+    out.resize(cur + 4 + len);
+    uint8_t *p = &out[cur];
+    memcpy(p, &len, 4);
+    uint32_t n = (uint32_t)cmd.size();
+    memcpy(p + 4, &n, 4);
+    p += 8;
+    for(const std::string &s : cmd)
+    {
+        uint32_t sz = (uint32_t)s.size();
+        memcpy(p, &sz, 4);
+        memcpy(p + 4, s.data(), s.size());
+        p += 4 + s.size();
+    }
+}
+
+// IN : int fd, const std::vector<std::string> &cmd
+// OUT : returns 0 on success, -1 on error
+// DESC: Send one request on a blocking socket
+int32_t send_req(int fd, const std::vector<std::string> &cmd)
+{
+    std::vector<uint8_t> wbuf;
+    encode_req(wbuf, cmd);
+    if(wbuf.size() > 4 + k_max_msg)
+    {
+        return -1;
+    }
+    return write_all(fd, (const char *)wbuf.data(), wbuf.size());
+}
+
+// IN : int fd, Reply &out
+// OUT : returns 0 on success, -1 on error; out holds the reply
+// DESC: Read one response from a blocking socket
+int32_t read_res(int fd, Reply &out)
+{
+    out.status = RES_IO;
+    out.data.clear();
+
+    uint32_t len = 0;
+    if(read_full(fd, (char *)&len, 4))
+    {
+        return -1;
+    }
+    if(len > k_max_msg || len < 4)
+    {
+        return -1;
+    }
+
+    uint32_t status = 0;
+    if(read_full(fd, (char *)&status, 4))
+    {
+        return -1;
+    }
+    out.data.resize(len - 4);
+    if(read_full(fd, &out.data[0], len - 4))
+    {
+        return -1;
+    }
+    out.status = status;
+    return 0;
+}
+
+// IN : const std::string &data, std::vector<std::string> &out
+// OUT : returns false on malformed input
+// DESC: Parse a string array (u32 count, then u32 len + bytes each), as
+//       carried by RES_PUSH messages
+bool decode_strs(const std::string &data, std::vector<std::string> &out)
+{
+    const char *cur = data.data();
+    const char *end = cur + data.size();
+    uint32_t n = 0;
+    if(end - cur < 4) return false;
+    memcpy(&n, cur, 4);
+    cur += 4;
+
+    out.clear();
+    for(uint32_t i = 0 ; i < n ; ++i)
+    {
+        uint32_t len = 0;
+        if(end - cur < 4) return false;
+        memcpy(&len, cur, 4);
+        cur += 4;
+        if((size_t)(end - cur) < len) return false;
+        out.emplace_back(cur, len);
+        cur += len;
+    }
+    return cur == end;
+}
+
+/*
+//////////////////////////////////
+PIPELINED CONNECTION
+//////////////////////////////////
+*/
+
+Connection::Connection(const std::string &host, uint16_t port)
+    : host(host), port(port)
+{
+}
+
+Connection::~Connection()
+{
+    close();
+}
+
+// IN : none
+// OUT : returns true if connected; the IO thread is running
+// DESC: (Re)connect to the server, dropping any previous socket
+bool Connection::connect()
+{
+    close();
+
+    int sock = port ? tcp_connect(host.c_str(), port) : unix_connect(host.c_str());
+    if(sock < 0)
+    {
+        return false;
+    }
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    int efd = eventfd(0, EFD_NONBLOCK);
+    if(efd < 0)
+    {
+        ::close(sock);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        fd = sock;
+        wake_fd = efd;
+        stopping = false;
+        alive = true;
+    }
+    io = std::thread(&Connection::io_loop, this);
+    return true;
+}
+
+// IN : none
+// OUT : IO thread stopped, socket closed, pending requests failed with RES_IO
+// DESC: Close the connection; safe to call more than once
+void Connection::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+        if(wake_fd >= 0)
+        {
+            uint64_t one = 1;
+            (void)!write(wake_fd, &one, sizeof(one));
+        }
+    }
+    if(io.joinable())
+    {
+        io.join();
+    }
+
+    std::lock_guard<std::mutex> lock(mu);
+    if(fd >= 0) ::close(fd);
+    if(wake_fd >= 0) ::close(wake_fd);
+    fd = -1;
+    wake_fd = -1;
+    alive = false;
+}
+
+// IN : ReplyCallback cb
+// OUT : none
+// DESC: Set the handler for RES_PUSH messages (pub/sub, invalidations)
+void Connection::set_push_handler(ReplyCallback cb)
+{
+    std::lock_guard<std::mutex> lock(mu);
+    push_cb = cb;
+}
+
+// IN : const std::vector<std::string> &cmd, ReplyCallback cb
+// OUT : cb is called on the IO thread with the reply, or with RES_IO
+// DESC: Queue a request without waiting for it
+void Connection::send(const std::vector<std::string> &cmd, ReplyCallback cb)
+{
+    std::unique_lock<std::mutex> lock(mu);
+    if(!alive || stopping)
+    {
+        lock.unlock();
+        Reply err;
+        cb(err);
+        return;
+    }
+
+    bool was_empty = wbuf.empty();
+    encode_req(wbuf, cmd);
+    waiting.push_back(std::move(cb));
+
+    // one wakeup per batch; the IO thread picks up the rest with it
+    if(was_empty)
+    {
+        uint64_t one = 1;
+        (void)!write(wake_fd, &one, sizeof(one));
+    }
+}
+
+// IN : const std::vector<std::string> &cmd
+// OUT : future resolved with the reply
+// DESC: Queue a request and return a future for its reply
+std::future<Reply> Connection::send(const std::vector<std::string> &cmd)
+{
+    std::shared_ptr<std::promise<Reply>> prom = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> fut = prom->get_future();
+    send(cmd, [prom](Reply &r) { prom->set_value(std::move(r)); });
+    return fut;
+}
+
+// IN : const std::vector<std::string> &cmd, ReplyCallback cb
+// OUT : cb is called with the reply to cmd
+// DESC: Queue "asking" and cmd back to back, so no other request can come
+//       between them; the reply to "asking" is dropped
+void Connection::send_asking(const std::vector<std::string> &cmd, ReplyCallback cb)
+{
+    std::unique_lock<std::mutex> lock(mu);
+    if(!alive || stopping)
+    {
+        lock.unlock();
+        Reply err;
+        cb(err);
+        return;
+    }
+
+    bool was_empty = wbuf.empty();
+    encode_req(wbuf, {"asking"});
+    waiting.push_back([](Reply &) {});
+    encode_req(wbuf, cmd);
+    waiting.push_back(std::move(cb));
+
+    if(was_empty)
+    {
+        uint64_t one = 1;
+        (void)!write(wake_fd, &one, sizeof(one));
+    }
+}
+
+// IN : none
+// OUT : number of requests sent or queued that have no reply yet
+// DESC: Used by the pool's health check
+size_t Connection::in_flight()
+{
+    std::lock_guard<std::mutex> lock(mu);
+    return waiting.size();
+}
+
+// IN : none
+// OUT : every queued callback is called with RES_IO
+// DESC: Fail the requests that will never get a reply
+void Connection::fail_waiting()
+{
+    std::deque<ReplyCallback> failed;
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        failed.swap(waiting);
+        wbuf.clear();
+    }
+    for(ReplyCallback &cb : failed)
+    {
+        Reply err;
+        cb(err);
+    }
+}
+
+// IN : none
+// OUT : runs until close() or a socket error
+// DESC: IO thread: write batched requests, read replies and dispatch them
+void Connection::io_loop()
+{
+    std::vector<uint8_t> out;
+    size_t out_pos = 0;
+    std::vector<uint8_t> in;
+    size_t in_pos = 0;
+
+    while(true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if(stopping) break;
+            if(out_pos == out.size())
+            {
+                out.clear();
+                out_pos = 0;
+                out.swap(wbuf);
+            }
+        }
+
+        // try to write right away, poll only when the socket is full
+        while(out_pos < out.size())
+        {
+            ssize_t rv = write(fd, &out[out_pos], out.size() - out_pos);
+            if(rv < 0 && errno == EAGAIN) break;
+            if(rv <= 0) goto L_DEAD;
+            out_pos += (size_t)rv;
+            io_bytes += (uint64_t)rv;
+        }
+
+        struct pollfd pfds[2] = {
+            {fd, POLLIN, 0},
+            {wake_fd, POLLIN, 0},
+        };
+        if(out_pos < out.size())
+        {
+            pfds[0].events |= POLLOUT;
+        }
+        if(poll(pfds, 2, -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            goto L_DEAD;
+        }
+
+        if(pfds[1].revents)
+        {
+            uint64_t cnt = 0;
+            (void)!read(wake_fd, &cnt, sizeof(cnt));
+        }
+        if(pfds[0].revents & (POLLERR | POLLHUP | POLLNVAL) && !(pfds[0].revents & POLLIN))
+        {
+            goto L_DEAD;
+        }
+        if(!(pfds[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        // read everything available, then dispatch complete replies
+        while(true)
+        {
+            size_t cur = in.size();
+            in.resize(cur + 64 * 1024);
+            ssize_t rv = read(fd, &in[cur], 64 * 1024);
+            in.resize(cur + (rv > 0 ? (size_t)rv : 0));
+            if(rv > 0) io_bytes += (uint64_t)rv;
+            if(rv < 0 && errno == EAGAIN) break;
+            if(rv <= 0) goto L_DEAD;
+        }
+
+        while(in.size() - in_pos >= 4)
+        {
+            uint32_t len = 0;
+            memcpy(&len, &in[in_pos], 4);
+            if(len > k_max_msg || len < 4) goto L_DEAD;
+            if(in.size() - in_pos < 4 + (size_t)len) break;
+
+            Reply reply;
+            memcpy(&reply.status, &in[in_pos + 4], 4);
+            reply.data.assign((const char *)&in[in_pos + 8], len - 4);
+            in_pos += 4 + len;
+
+            ReplyCallback cb;
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                if(reply.status == RES_PUSH)
+                {
+                    cb = push_cb;
+                }
+                else if(!waiting.empty())
+                {
+                    cb = std::move(waiting.front());
+                    waiting.pop_front();
+                }
+            }
+            if(cb) cb(reply);
+        }
+        if(in_pos > 0)
+        {
+            in.erase(in.begin(), in.begin() + in_pos);
+            in_pos = 0;
+        }
+    }
+
+L_DEAD:
+    alive = false;
+    fail_waiting();
+}
+
+/*
+//////////////////////////////////
+CONNECTION POOL
+//////////////////////////////////
+*/
+
+ConnPool::ConnPool(const std::string &host, uint16_t port, size_t size,
+                   uint32_t check_interval_ms, uint32_t check_timeout_ms)
+    : check_interval_ms(check_interval_ms), check_timeout_ms(check_timeout_ms)
+{
+    for(size_t i = 0 ; i < size ; ++i)
+    {
+        Connection *conn = new Connection(host, port);
+        conn->connect();
+        conns.push_back(conn);
+    }
+    checker = std::thread(&ConnPool::check_loop, this);
+}
+
+ConnPool::~ConnPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    cv.notify_all();
+    checker.join();
+    for(Connection *conn : conns)
+    {
+        delete conn;
+    }
+}
+
+// IN : none
+// OUT : a healthy connection, or NULL if none is up
+// DESC: Pick the next healthy connection round-robin
+Connection *ConnPool::get()
+{
+    size_t n = conns.size();
+    size_t start = next.fetch_add(1);
+    for(size_t i = 0 ; i < n ; ++i)
+    {
+        Connection *conn = conns[(start + i) % n];
+        if(conn->healthy()) return conn;
+    }
+    return NULL;
+}
+
+// IN : const std::vector<std::string> &cmd, ReplyCallback cb
+// OUT : cb called with the reply, or RES_IO if no connection is up
+// DESC: Send a request on any healthy connection
+void ConnPool::send(const std::vector<std::string> &cmd, ReplyCallback cb)
+{
+    Connection *conn = get();
+    if(!conn)
+    {
+        Reply err;
+        cb(err);
+        return;
+    }
+    conn->send(cmd, std::move(cb));
+}
+
+// IN : const std::vector<std::string> &cmd
+// OUT : future resolved with the reply
+// DESC: Send a request on any healthy connection
+std::future<Reply> ConnPool::send(const std::vector<std::string> &cmd)
+{
+    std::shared_ptr<std::promise<Reply>> prom = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> fut = prom->get_future();
+    send(cmd, [prom](Reply &r) { prom->set_value(std::move(r)); });
+    return fut;
+}
+
+// IN : none
+// OUT : number of connections currently up
+// DESC: Pool health summary
+size_t ConnPool::healthy_count()
+{
+    size_t n = 0;
+    for(Connection *conn : conns)
+    {
+        n += conn->healthy() ? 1 : 0;
+    }
+    return n;
+}
+
+// IN : none
+// OUT : runs until the pool is destroyed
+// DESC: Health check thread: ping idle connections, reconnect dead ones.
+//       A ping would wait behind whatever is in flight (large values, a
+//       blocked bitop), so a busy connection is judged by its progress.
+void ConnPool::check_loop()
+{
+    std::vector<uint64_t> last_io(conns.size(), 0);
+    std::vector<bool> last_busy(conns.size(), false);
+    std::unique_lock<std::mutex> lock(mu);
+    while(!stopping)
+    {
+        cv.wait_for(lock, std::chrono::milliseconds(check_interval_ms));
+        if(stopping) break;
+        lock.unlock();
+
+        for(size_t i = 0 ; i < conns.size() ; ++i)
+        {
+            Connection *conn = conns[i];
+            if(!conn->healthy())
+            {
+                conn->connect();
+                last_busy[i] = false;
+                continue;
+            }
+
+            uint64_t io = conn->progress();
+            bool busy = conn->in_flight() > 0;
+            bool stuck = busy && last_busy[i] && io == last_io[i];
+            last_io[i] = io;
+            last_busy[i] = busy;
+            if(busy)
+            {
+                // busy for a whole interval without a byte moving
+                if(stuck) conn->close();
+                continue;
+            }
+
+            std::future<Reply> fut = conn->send({"ping"});
+            if(fut.wait_for(std::chrono::milliseconds(check_timeout_ms)) != std::future_status::ready
+                || fut.get().status != RES_OK)
+            {
+                conn->close();
+            }
+        }
+
+        lock.lock();
+    }
+}
+
+/*
+//////////////////////////////////
+CLUSTER CLIENT
+//////////////////////////////////
+*/
+
+// IN : const std::vector<std::string> &cmd
+// OUT : the key cmd is routed by, or NULL
+// DESC: Keyed commands, as checked by the server
+static const std::string *cmd_key(const std::vector<std::string> &cmd)
+{
+    if(cmd.size() == 2 && (cmd[0] == "get" || cmd[0] == "del")) return &cmd[1];
+    if(cmd.size() == 3 && cmd[0] == "set") return &cmd[1];
+    if(cmd.size() >= 2 && (cmd[0] == "setbit" || cmd[0] == "getbit"
+        || cmd[0] == "bitcount" || cmd[0] == "bitpos"))
+    {
+        return &cmd[1];
+    }
+    if(cmd.size() >= 4 && cmd[0] == "bitop") return &cmd[2];
+    return NULL;
+}
+
+ClusterClient::ClusterClient(const std::string &host, uint16_t port)
+    : seed(host + ":" + std::to_string(port)), slots(k_cluster_slots)
+{
+}
+
+ClusterClient::~ClusterClient()
+{
+    for(std::pair<const std::string, Connection *> &it : conns)
+    {
+        it.second->close();
+    }
+    for(Connection *conn : retired)
+    {
+        conn->close();
+    }
+    for(std::pair<const std::string, Connection *> &it : conns)
+    {
+        delete it.second;
+    }
+    for(Connection *conn : retired)
+    {
+        delete conn;
+    }
+}
+
+// IN : const std::string &addr
+// OUT : a live connection to addr, or NULL if it cannot be reached
+// DESC: Get or open the connection to a node; a dead one is replaced
+Connection *ClusterClient::node(const std::string &addr)
+{
+    std::lock_guard<std::mutex> lock(mu);
+    std::map<std::string, Connection *>::iterator it = conns.find(addr);
+    if(it != conns.end())
+    {
+        if(it->second->healthy()) return it->second;
+        retired.push_back(it->second);     // its IO thread may be running us
+        conns.erase(it);
+    }
+
+    size_t colon = addr.rfind(':');
+    if(colon == std::string::npos) return NULL;
+    Connection *conn = new Connection(addr.substr(0, colon),
+                                      (uint16_t)atoi(addr.c_str() + colon + 1));
+    if(!conn->connect())
+    {
+        delete conn;
+        return NULL;
+    }
+    conns[addr] = conn;
+    return conn;
+}
+
+// IN : none
+// OUT : returns false if the seed did not answer "cluster slots"
+// DESC: Reload the whole slot map from the seed node
+bool ClusterClient::refresh()
+{
+    Connection *conn = node(seed);
+    if(!conn) return false;
+
+    Reply reply = conn->send({"cluster", "slots"}).get();
+    if(reply.status != RES_OK) return false;
+
+    std::vector<std::string> map(k_cluster_slots);
+    size_t pos = 0;
+    while(pos < reply.data.size())
+    {
+        size_t eol = reply.data.find('\n', pos);
+        if(eol == std::string::npos) eol = reply.data.size();
+        std::string line = reply.data.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        unsigned lo = 0, hi = 0;
+        char addr[256] = {};
+        if(sscanf(line.c_str(), "%u %u %255s", &lo, &hi, addr) != 3 || hi >= k_cluster_slots)
+        {
+            return false;
+        }
+        for(unsigned i = lo ; i <= hi ; ++i)
+        {
+            map[i] = addr;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mu);
+    slots.swap(map);
+    return true;
+}
+
+// IN : const std::string &key
+// OUT : "host:port" the key is currently routed to
+// DESC: Lookup in the cached slot map
+std::string ClusterClient::node_for(const std::string &key)
+{
+    uint16_t slot = key_slot((const uint8_t *)key.data(), key.size());
+    std::lock_guard<std::mutex> lock(mu);
+    return slots[slot].empty() ? seed : slots[slot];
+}
+
+// IN : CmdPtr cmd, ReplyCallback cb, const std::string &addr, bool asking, int hops
+// OUT : cb called with the final reply
+// DESC: Send cmd to addr and follow up to k_max_redirects redirects
+void ClusterClient::route(CmdPtr cmd, ReplyCallback cb, const std::string &addr,
+                          bool asking, int hops)
+{
+    Connection *conn = node(addr);
+    if(!conn)
+    {
+        Reply err;
+        cb(err);
+        return;
+    }
+
+    ReplyCallback handler = [this, cmd, cb, hops](Reply &reply) {
+        bool redirect = reply.status == RES_MOVED || reply.status == RES_ASK;
+        size_t sp = reply.data.find(' ');
+        if(!redirect || hops >= k_max_redirects || sp == std::string::npos)
+        {
+            cb(reply);
+            return;
+        }
+
+        std::string target = reply.data.substr(sp + 1);
+        if(reply.status == RES_MOVED)
+        {
+            unsigned long slot = strtoul(reply.data.c_str(), NULL, 10);
+            std::lock_guard<std::mutex> lock(mu);
+            if(slot < k_cluster_slots) slots[slot] = target;
+        }
+        route(cmd, cb, target, reply.status == RES_ASK, hops + 1);
+    };
+
+    if(asking)
+    {
+        conn->send_asking(*cmd, std::move(handler));
+    }
+    else
+    {
+        conn->send(*cmd, std::move(handler));
+    }
+}
+
+// IN : const std::vector<std::string> &cmd, ReplyCallback cb
+// OUT : cb called with the reply, or RES_IO
+// DESC: Send a request to the node owning its key
+void ClusterClient::send(const std::vector<std::string> &cmd, ReplyCallback cb)
+{
+    const std::string *key = cmd_key(cmd);
+    std::string addr = key ? node_for(*key) : seed;
+    route(std::make_shared<const std::vector<std::string>>(cmd), std::move(cb), addr, false, 0);
+}
+
+// IN : const std::vector<std::string> &cmd
+// OUT : future resolved with the reply
+// DESC: Send a request to the node owning its key
+std::future<Reply> ClusterClient::send(const std::vector<std::string> &cmd)
+{
+    std::shared_ptr<std::promise<Reply>> prom = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> fut = prom->get_future();
+    send(cmd, [prom](Reply &r) { prom->set_value(std::move(r)); });
+    return fut;
+}
+
+/*
+//////////////////////////////////
+NEAR CACHE
+//////////////////////////////////
+*/
+
+NearCache::NearCache(Connection &conn, size_t max_entries)
+    : conn(conn), max_entries(max_entries)
+{
+}
+
+// IN : none
+// OUT : returns true once the server tracks reads on the connection
+// DESC: Install the invalidation handler and turn tracking on
+bool NearCache::start()
+{
+    conn.set_push_handler([this](Reply &r) { on_push(r); });
+    Reply reply = conn.send({"tracking", "on"}).get();
+    enabled = reply.status == RES_OK;
+    return enabled;
+}
+
+// IN : Reply &reply
+// OUT : the invalidated keys are dropped from the cache
+// DESC: Push handler, runs on the IO thread
+void NearCache::on_push(Reply &reply)
+{
+    std::vector<std::string> msg;
+    if(!decode_strs(reply.data, msg) || msg.empty() || msg[0] != "invalidate")
+    {
+        return;
+    }
+
+    ninvalidations++;
+    std::lock_guard<std::mutex> lock(mu);
+    if(msg.size() == 1)
+    {
+        cache.clear();
+        return;
+    }
+    for(size_t i = 1 ; i < msg.size() ; ++i)
+    {
+        cache.erase(msg[i]);
+    }
+}
+
+// IN : const std::string &key
+// OUT : key no longer cached
+// DESC: Drop one entry
+void NearCache::drop(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(mu);
+    cache.erase(key);
+}
+
+// IN : none
+// OUT : number of cached keys
+// DESC: Cache size
+size_t NearCache::size()
+{
+    std::lock_guard<std::mutex> lock(mu);
+    return cache.size();
+}
+
+// IN : const std::string &key
+// OUT : the value (RES_OK), RES_NX, or RES_IO
+// DESC: Serve from the cache, or read from the server and cache the reply.
+//       Missing keys are cached too.
+Reply NearCache::get(const std::string &key)
+{
+    if(enabled && !conn.healthy())
+    {
+        // invalidations may have been lost with the connection
+        enabled = false;
+        std::lock_guard<std::mutex> lock(mu);
+        cache.clear();
+    }
+
+    if(enabled)
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        std::unordered_map<std::string, Reply>::iterator it = cache.find(key);
+        if(it != cache.end())
+        {
+            nhits++;
+            return it->second;
+        }
+    }
+    nmisses++;
+
+    // cache the reply from the IO thread, ordered with the invalidations
+    std::shared_ptr<std::promise<Reply>> prom = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> fut = prom->get_future();
+    conn.send({"get", key}, [this, key, prom](Reply &r) {
+        if(enabled && (r.status == RES_OK || r.status == RES_NX))
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if(cache.size() >= max_entries && !cache.empty())
+            {
+                cache.erase(cache.begin());
+            }
+            cache[key] = r;
+        }
+        prom->set_value(std::move(r));
+    });
+    return fut.get();
+}
+
+// IN : const std::string &key, const std::string &val
+// OUT : the server's reply
+// DESC: Write through; the local copy is dropped right away, the server's
+//       invalidation follows
+Reply NearCache::set(const std::string &key, const std::string &val)
+{
+    drop(key);
+    return conn.send({"set", key, val}).get();
+}
+
+// IN : const std::string &key
+// OUT : the server's reply
+// DESC: Delete through the server, dropping the local copy
+Reply NearCache::del(const std::string &key)
+{
+    drop(key);
+    return conn.send({"del", key}).get();
+}
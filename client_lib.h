@@ -0,0 +1,197 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+// C++
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+
+// Response status codes, as sent by the server.
+enum
+{
+    RES_OK   = 0,
+    RES_ERR  = 1,
+    RES_NX   = 2,
+    RES_PUSH = 3,
+    RES_MOVED = 4,      // cluster: data is "<slot> <host:port>"
+    RES_ASK  = 5,       // cluster: retry once on that node after "asking"
+    RES_IO   = 0xFFFF,  // client side only: the connection failed before a reply
+};
+
+const size_t k_max_msg = 32 << 20;
+
+// One server reply.
+struct Reply
+{
+    uint32_t status = RES_IO;
+    std::string data;
+};
+
+typedef std::function<void (Reply &)> ReplyCallback;
+
+// Blocking helpers: one request in flight per socket.
+int     tcp_connect(const char *host, uint16_t port);
+int     unix_connect(const char *path);
+void    encode_req(std::vector<uint8_t> &out, const std::vector<std::string> &cmd);
+int32_t send_req(int fd, const std::vector<std::string> &cmd);
+int32_t read_res(int fd, Reply &out);
+bool    decode_strs(const std::string &data, std::vector<std::string> &out);
+
+// Pipelined connection.
+// Requests are serialized into a shared buffer by the calling thread and
+// written by a background IO thread, so everything queued while a write is
+// in progress goes out together in the next write. Replies are matched to
+// requests in FIFO order; RES_PUSH messages go to the push handler instead.
+// Callbacks run on the IO thread. With port 0, host is the path of a Unix
+// domain socket (this also applies to ConnPool).
+class Connection
+{
+public:
+    Connection(const std::string &host, uint16_t port);
+    ~Connection();
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    bool connect();
+    void close();
+    bool healthy() const { return alive.load(); }
+    uint64_t progress() const { return io_bytes.load(); }
+    size_t in_flight();
+
+    void send(const std::vector<std::string> &cmd, ReplyCallback cb);
+    std::future<Reply> send(const std::vector<std::string> &cmd);
+    void send_asking(const std::vector<std::string> &cmd, ReplyCallback cb);
+    void set_push_handler(ReplyCallback cb);
+
+private:
+    void io_loop();
+    void fail_waiting();
+
+    std::string host;
+    uint16_t port = 0;
+    int fd = -1;
+    int wake_fd = -1;
+    std::thread io;
+    std::atomic<bool> alive{false};
+    std::atomic<uint64_t> io_bytes{0};  // bytes written or read, ever
+
+    std::mutex mu;                      // guards everything below
+    bool stopping = false;
+    std::vector<uint8_t> wbuf;          // requests not yet handed to the IO thread
+    std::deque<ReplyCallback> waiting;  // one per request sent or queued
+    ReplyCallback push_cb;
+};
+
+// Fixed-size pool of pipelined connections.
+// Requests are spread round-robin over healthy connections. A background
+// thread pings every idle connection each interval, closes the ones that do
+// not answer in time and reconnects closed ones. A ping would queue behind
+// the requests in flight, so busy connections are not pinged: one is closed
+// only if no byte moved either way between two checks that both found it busy.
+class ConnPool
+{
+public:
+    ConnPool(const std::string &host, uint16_t port, size_t size,
+             uint32_t check_interval_ms = 1000, uint32_t check_timeout_ms = 500);
+    ~ConnPool();
+    ConnPool(const ConnPool &) = delete;
+    ConnPool &operator=(const ConnPool &) = delete;
+
+    Connection *get();
+    void send(const std::vector<std::string> &cmd, ReplyCallback cb);
+    std::future<Reply> send(const std::vector<std::string> &cmd);
+    size_t healthy_count();
+
+private:
+    void check_loop();
+
+    std::vector<Connection *> conns;
+    std::atomic<size_t> next{0};
+    uint32_t check_interval_ms;
+    uint32_t check_timeout_ms;
+    std::thread checker;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+// Cluster client.
+// Keeps a slot -> node map, loaded with "cluster slots" from a seed node, and
+// sends each keyed command straight to the node that owns its slot over one
+// pipelined Connection per node. MOVED replies update the map and the
+// command is retried there; ASK replies retry once on the given node after
+// "asking", without touching the map. Commands without a key go to the seed.
+class ClusterClient
+{
+public:
+    ClusterClient(const std::string &host, uint16_t port);
+    ~ClusterClient();
+    ClusterClient(const ClusterClient &) = delete;
+    ClusterClient &operator=(const ClusterClient &) = delete;
+
+    bool refresh();
+    void send(const std::vector<std::string> &cmd, ReplyCallback cb);
+    std::future<Reply> send(const std::vector<std::string> &cmd);
+    std::string node_for(const std::string &key);
+
+private:
+    typedef std::shared_ptr<const std::vector<std::string>> CmdPtr;
+
+    Connection *node(const std::string &addr);
+    void route(CmdPtr cmd, ReplyCallback cb, const std::string &addr, bool asking, int hops);
+
+    std::string seed;                           // "host:port"
+    std::mutex mu;                              // guards everything below
+    std::vector<std::string> slots;             // owner per slot, "" if unknown
+    std::map<std::string, Connection *> conns;  // by "host:port"
+    std::vector<Connection *> retired;          // dead, freed in the destructor
+};
+
+// Client side cache of values, kept coherent by server invalidations.
+// start() turns on "tracking" for the connection: the server remembers
+// every key read through it and pushes ["invalidate", key] when one changes,
+// or ["invalidate"] to drop everything when its tracking table overflows.
+// Replies and invalidations are applied on the connection's IO thread in
+// stream order, so a value is never cached after its invalidation. The
+// cache takes over the connection's push handler; it is emptied and
+// bypassed while the connection is down. At most max_entries values are
+// kept; beyond that arbitrary entries are dropped.
+class NearCache
+{
+public:
+    NearCache(Connection &conn, size_t max_entries);
+    NearCache(const NearCache &) = delete;
+    NearCache &operator=(const NearCache &) = delete;
+
+    bool start();
+    Reply get(const std::string &key);
+    Reply set(const std::string &key, const std::string &val);
+    Reply del(const std::string &key);
+
+    size_t size();
+    uint64_t hits() const { return nhits.load(); }
+    uint64_t misses() const { return nmisses.load(); }
+    uint64_t invalidations() const { return ninvalidations.load(); }
+
+private:
+    void on_push(Reply &reply);
+    void drop(const std::string &key);
+
+    Connection &conn;
+    size_t max_entries;
+    std::atomic<bool> enabled{false};
+    std::atomic<uint64_t> nhits{0}, nmisses{0}, ninvalidations{0};
+
+    std::mutex mu;                                      // guards cache
+    std::unordered_map<std::string, Reply> cache;       // RES_OK or RES_NX replies
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Cluster key space: keys map to one of 16384 hash slots by CRC16 (XMODEM)
+// of the key. If the key contains "{...}" with a non-empty body, only the
+// body is hashed, so related keys can be forced into the same slot.
+const uint32_t k_cluster_slots = 16384;
+
+uint16_t crc16(const uint8_t *data, size_t len);
+uint16_t key_slot(const uint8_t *key, size_t len);
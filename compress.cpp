@@ -0,0 +1,235 @@
+#include <string.h>
+#include "compress.h"
+
+// format limits
+const size_t k_min_match = 4;
+const size_t k_last_literals = 5;   // the last 5 bytes are always literals
+const size_t k_mf_limit = 12;       // no match may start in the last 12 bytes
+const size_t k_max_offset = 65535;
+const int k_hash_log = 12;
+
+// IN : const uint8_t *p
+// OUT : 4 bytes at p
+// DESC: Unaligned 32-bit load
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// IN : uint32_t seq
+// OUT : table index in [0, 2^k_hash_log)
+// DESC: Multiplicative hash of the next 4 input bytes
+static uint32_t hash4(uint32_t seq)
+{
+    return (seq * 2654435761u) >> (32 - k_hash_log);
+}
+
+// IN : const uint8_t *a, const uint8_t *b, const uint8_t *end
+// OUT : number of equal bytes from a and b, stopping at end (for a)
+// DESC: Extend a match 8 bytes at a time
+static size_t match_len(const uint8_t *a, const uint8_t *b, const uint8_t *end)
+{
+    const uint8_t *start = a;
+    while(a + 8 <= end)
+    {
+        uint64_t x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if(x != y)
+        {
+            return (size_t)(a - start) + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+    while(a < end && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return (size_t)(a - start);
+}
+
+// IN : uint8_t *&op, uint8_t *oend, size_t len
+// OUT : returns false if the output is full
+// DESC: Write the 255-run continuation bytes of a length field
+static bool put_len(uint8_t *&op, uint8_t *oend, size_t len)
+{
+    for( ; len >= 255 ; len -= 255)
+    {
+        if(op >= oend) return false;
+        *op++ = 255;
+    }
+    if(op >= oend) return false;
+    *op++ = (uint8_t)len;
+    return true;
+}
+
+// IN : uint8_t *&op, uint8_t *oend, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen
+// OUT : returns false if the output is full
+// DESC: Emit one sequence: token, literals, then the match (mlen 0 = last sequence)
+static bool put_seq(uint8_t *&op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                    size_t offset, size_t mlen)
+{
+    if(op >= oend) return false;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+    if(nlit >= 15 && !put_len(op, oend, nlit - 15)) return false;
+
+    if((size_t)(oend - op) < nlit) return false;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if(mlen == 0) return true;
+
+    if(oend - op < 2) return false;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = mlen - k_min_match;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if(ml >= 15 && !put_len(op, oend, ml - 15)) return false;
+    return true;
+}
+
+// IN : size_t n
+// OUT : max compressed size
+// DESC: Worst case is all literals plus length bytes
+size_t lz4_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+// IN : const uint8_t *src, size_t n, uint8_t *dst, size_t cap
+// OUT : compressed size, 0 if it does not fit
+// DESC: Greedy LZ4 compression with one hash probe per position; the step
+//       grows while no match is found so incompressible data is skipped fast
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    size_t anchor = 0;
+
+    if(n > k_mf_limit)
+    {
+        uint32_t table[1 << k_hash_log] = {};
+        size_t limit = n - k_mf_limit;
+        size_t ip = 1;
+        while(ip < limit)
+        {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+
+            if(ip - ref > k_max_offset || read32(src + ref) != seq || ref >= ip)
+            {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t mlen = k_min_match + match_len(src + ip + k_min_match, src + ref + k_min_match,
+                                                  src + n - k_last_literals);
+            if(!put_seq(op, oend, src + anchor, ip - anchor, ip - ref, mlen)) return 0;
+            ip += mlen;
+            anchor = ip;
+
+            if(ip < limit)
+            {
+                table[hash4(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+            }
+        }
+    }
+
+    if(!put_seq(op, oend, src + anchor, n - anchor, 0, 0)) return 0;
+    return (size_t)(op - dst);
+}
+
+// IN : const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len
+// OUT : returns false on malformed input
+// DESC: Decode an LZ4 block, checking every read and write against the bounds
+bool lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + n;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + raw_len;
+
+    while(ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if(nlit == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if(ip >= iend) return false;
+                b = *ip++;
+                nlit += b;
+            } while(b == 255);
+        }
+        if((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return false;
+        if(nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+        {
+            memcpy(op, ip, 16);     // fixed size copy, the overrun is rewritten later
+        }
+        else
+        {
+            memcpy(op, ip, nlit);
+        }
+        ip += nlit;
+        op += nlit;
+
+        if(ip == iend) break;   // last sequence has no match
+
+        if(iend - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - dst)) return false;
+
+        size_t mlen = token & 15;
+        if(mlen == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if(ip >= iend) return false;
+                b = *ip++;
+                mlen += b;
+            } while(b == 255);
+        }
+        mlen += k_min_match;
+        if((size_t)(oend - op) < mlen) return false;
+
+        const uint8_t *match = op - offset;
+        if(offset >= 8 && (size_t)(oend - op) >= mlen + 8)
+        {
+            // 8 bytes at a time, may write up to 7 bytes past the match
+            uint8_t *end = op + mlen;
+            while(op < end)
+            {
+                memcpy(op, match, 8);
+                op += 8;
+                match += 8;
+            }
+            op = end;
+        }
+        else if(offset >= mlen)
+        {
+            memcpy(op, match, mlen);
+            op += mlen;
+        }
+        else
+        {
+            for(size_t i = 0 ; i < mlen ; ++i)
+            {
+                *op++ = *match++;   // overlapping copy repeats the pattern
+            }
+        }
+    }
+
+    return op == oend;
+}
\ No newline at end of file
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// LZ4 block format codec (no frame header, no checksum).
+// Greedy single-probe matcher: fast, modest ratio, good on text and JSON.
+
+// Worst case compressed size for n input bytes.
+size_t lz4_bound(size_t n);
+
+// Compress n bytes from src into dst (cap bytes).
+// Returns the compressed size, or 0 if it does not fit in cap.
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// Decompress a block that expands to exactly raw_len bytes.
+// Returns false on malformed input.
+bool   lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len);
\ No newline at end of file
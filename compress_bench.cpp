@@ -0,0 +1,77 @@
+// Compression benchmark: memory saved vs. time added to GET, by value size.
+//
+//   compress_bench
+//
+// Values are JSON documents like the ones we cache. For each size the table
+// shows the compression ratio, the memory saved per value, the cost paid once
+// on SET (compress) and the cost added to every GET (decompress).
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "compress.h"
+
+
+static double now_usec()
+{
+    using namespace std::chrono;
+    return duration<double, std::micro>(steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string make_json(size_t size)
+{
+    static const char *names[] = {"alice", "bob", "carol", "dave", "erin", "frank"};
+    static const char *tags[] = {"admin", "beta", "trial", "eu", "us", "mobile"};
+    std::string out = "[";
+    for(unsigned i = 0 ; out.size() < size ; ++i)
+    {
+        unsigned r = (unsigned)rand();
+        out += "{\"id\":" + std::to_string(100000 + r % 900000)
+            + ",\"name\":\"" + names[r % 6] + std::to_string(i) + "\""
+            + ",\"score\":" + std::to_string(r % 1000) + "." + std::to_string(r % 97)
+            + ",\"active\":" + (r % 3 ? "true" : "false")
+            + ",\"tags\":[\"" + tags[r % 6] + "\",\"" + tags[(r >> 8) % 6] + "\"]},";
+    }
+    out.resize(size);
+    return out;
+}
+
+int main()
+{
+    srand(1);
+    printf("%10s %10s %7s %12s %14s %14s %10s\n",
+           "size", "stored", "ratio", "saved/value", "compress us", "get +us", "get MB/s");
+
+    for(size_t size = 256 ; size <= (8 << 20) ; size *= 4)
+    {
+        std::string raw = make_json(size);
+        std::vector<uint8_t> packed(lz4_bound(size));
+        std::vector<uint8_t> back(size);
+
+        size_t iters = (64 << 20) / size + 1;
+        size_t m = 0;
+        double t0 = now_usec();
+        for(size_t i = 0 ; i < iters ; ++i)
+        {
+            m = lz4_compress((const uint8_t *)raw.data(), size, packed.data(), packed.size());
+        }
+        double c_us = (now_usec() - t0) / iters;
+
+        t0 = now_usec();
+        for(size_t i = 0 ; i < iters ; ++i)
+        {
+            if(!lz4_decompress(packed.data(), m, back.data(), size))
+            {
+                fprintf(stderr, "decompress failed\n");
+                return 1;
+            }
+        }
+        double d_us = (now_usec() - t0) / iters;
+
+        printf("%10zu %10zu %7.2f %11.1f%% %14.2f %14.2f %10.0f\n",
+               size, m, (double)size / m, 100.0 * (size - m) / size,
+               c_us, d_us, size / d_us);
+    }
+    return 0;
+}
@@ -4,7 +4,10 @@
 
 // constant work
 const size_t k_rehashing_work = 128;
-const size_t k_max_load_factor = 8;
+const size_t k_empty_visits = 10;       // empty slots scanned per unit of rehashing work
+const size_t k_max_load_factor = 8;     // grow above this many keys per slot
+const size_t k_target_load_factor = 4;  // load right after a shrink or reserve
+const size_t k_min_slots = 4;
 
 // IN : HTab *htab, size_t n
 // OUT : htab is initialized
@@ -57,18 +60,34 @@ static HNode *h_detach(HTab *htab, HNode **from)
     return node;
 }
 
-// IN : HMap *hmap
+// IN : size_t n
+// OUT : power of 2 slot count
+// DESC: Table size that holds n keys at the target load factor
+static size_t slots_for(size_t n)
+{
+    size_t slots = k_min_slots;
+    while(slots * k_target_load_factor < n)
+    {
+        slots *= 2;
+    }
+    return slots;
+}
+
+// IN : HMap *hmap, size_t max_work
 // OUT : migrates some nodes from oldMap to newMap
-// DESC: Helper function for incremental rehashing; moves up to k_rehashing_work nodes
-static void hm_help_rehashing(HMap *hmap)
+// DESC: Incremental rehashing; moves up to max_work nodes and scans at most
+//       max_work * k_empty_visits empty slots, so sparse tables stay cheap
+static void hm_migrate(HMap *hmap, size_t max_work)
 {
     size_t nwork = 0;
-    while(nwork < k_rehashing_work && hmap->oldMap.size > 0)
+    size_t nempty = 0;
+    while(nwork < max_work && hmap->oldMap.size > 0)
     {
         HNode **from = &hmap->oldMap.tab[hmap->migrate_pos];
         if(!*from)
         {
             hmap->migrate_pos++;
+            if(++nempty >= max_work * k_empty_visits) break;
             continue;
         }
         h_insert(&hmap->newMap, h_detach(&hmap->oldMap, from));
@@ -82,18 +101,60 @@ static void hm_help_rehashing(HMap *hmap)
     }
 }
 
-// IN : HMap *hmap
+// IN : HMap *hmap, size_t nslots
 // OUT : oldMap and newMap updated
-// DESC: Trigger full rehashing by promoting newMap to oldMap and allocating a larger newMap
-static void hm_trigger_rehashing(HMap *hmap)
+// DESC: Start resizing by promoting newMap to oldMap and allocating a newMap of nslots
+static void hm_start_resize(HMap *hmap, size_t nslots)
 {
     assert(hmap->oldMap.tab == NULL);
 
     hmap->oldMap = hmap->newMap;
-    h_init(&hmap->newMap, (hmap->newMap.mask + 1) * 2);
+    h_init(&hmap->newMap, nslots);
     hmap->migrate_pos = 0;
 }
 
+// IN : HMap *hmap
+// OUT : a grow is started if the table is over the max load factor
+// DESC: Normally doubles; after growth was paused by an iterator the table
+//       may be far behind, then it is sized for the current keys at once
+static void hm_maybe_grow(HMap *hmap)
+{
+    if(hmap->oldMap.tab || hmap->iterators > 0 || !hmap->newMap.tab) return;
+
+    size_t slots = hmap->newMap.mask + 1;
+    if(hmap->newMap.size >= slots * k_max_load_factor)
+    {
+        size_t want = slots_for(hmap->newMap.size);
+        hm_start_resize(hmap, want > slots * 2 ? want : slots * 2);
+    }
+}
+
+// IN : HMap *hmap
+// OUT : migrates some nodes from oldMap to newMap
+// DESC: Helper function for incremental rehashing, piggy-backed on every operation
+static void hm_help_rehashing(HMap *hmap)
+{
+    if(hmap->iterators > 0) return;
+
+    hm_migrate(hmap, k_rehashing_work);
+    hm_maybe_grow(hmap);
+}
+
+// IN : HMap *hmap
+// OUT : a shrink is started if the table is mostly empty
+// DESC: Shrink once the load factor drops below 1/2
+static void hm_maybe_shrink(HMap *hmap)
+{
+    if(hmap->oldMap.tab || hmap->iterators > 0 || !hmap->newMap.tab) return;
+
+    size_t slots = hmap->newMap.mask + 1;
+    if(slots > k_min_slots && hmap->newMap.size * 2 < slots)
+    {
+        size_t want = slots_for(hmap->newMap.size);
+        if(want < slots) hm_start_resize(hmap, want);
+    }
+}
+
 // IN : HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)
 // OUT : returns pointer to node if found, NULL if not
 // DESC: Lookup a node in the hash map, performing incremental rehashing if needed
@@ -115,27 +176,23 @@ void hm_insert(HMap *hmap, HNode *node)
     if(!hmap->newMap.tab) h_init(&hmap->newMap, 4); 
 
     h_insert(&hmap->newMap, node);
-
-    if(!hmap->oldMap.tab)
-    {
-        size_t shreshold = (hmap->newMap.mask + 1) * k_max_load_factor;
-        if(hmap->newMap.size >= shreshold) hm_trigger_rehashing(hmap);
-    }
-
+    hm_maybe_grow(hmap);
     hm_help_rehashing(hmap);
 }
 
 // IN : HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)
 // OUT : removes the node from the hash map, returns it if found, NULL if not
-// DESC: Delete a key from the hash map, handling incremental rehashing
+// DESC: Delete a key from the hash map, handling incremental rehashing and shrinking
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) 
 {
     hm_help_rehashing(hmap);
 
-    if(HNode **from = h_lookup(&hmap->newMap, key, eq)) return h_detach(&hmap->newMap, from);
-    if(HNode **from = h_lookup(&hmap->oldMap, key, eq)) return h_detach(&hmap->oldMap, from);
+    HNode *node = NULL;
+    if(HNode **from = h_lookup(&hmap->newMap, key, eq)) node = h_detach(&hmap->newMap, from);
+    else if(HNode **from = h_lookup(&hmap->oldMap, key, eq)) node = h_detach(&hmap->oldMap, from);
 
-    return NULL;
+    if(node) hm_maybe_shrink(hmap);
+    return node;
 }
 
 // IN : HMap *hmap
@@ -155,3 +212,109 @@ size_t hm_size(HMap *hmap)
 {
     return hmap->newMap.size + hmap->oldMap.size;
 }
+
+
+// IN : HMap *hmap, HMapIter *iter
+// OUT : iter positioned at the first slot, rehashing paused
+// DESC: Open an incremental cursor over the hash map
+void hm_iter_init(HMap *hmap, HMapIter *iter)
+{
+    iter->hmap = hmap;
+    iter->table = 0;
+    iter->pos = 0;
+    hmap->iterators++;
+}
+
+// IN : HMapIter *iter, size_t max_work, void (*f)(HNode *, void *), void *arg
+// OUT : returns false once every slot has been visited
+// DESC: Call f on the nodes of the next few slots; whole chains are visited so
+//       max_work may be exceeded by one chain. f may detach the node it is given.
+bool hm_iter_next(HMapIter *iter, size_t max_work, void (*f)(HNode *, void *), void *arg)
+{
+    size_t nwork = 0;
+    while(iter->table < 2 && nwork < max_work)
+    {
+        HTab *htab = iter->table == 0 ? &iter->hmap->newMap : &iter->hmap->oldMap;
+        if(!htab->tab || iter->pos > htab->mask)
+        {
+            iter->table++;
+            iter->pos = 0;
+            continue;
+        }
+
+        HNode *node = htab->tab[iter->pos++];
+        while(node)
+        {
+            HNode *next = node->next;
+            f(node, arg);
+            node = next;
+            nwork++;
+        }
+        nwork++;    // count empty slots too, so sparse tables still yield
+    }
+    return iter->table < 2;
+}
+
+// IN : HMapIter *iter
+// OUT : rehashing resumes once no cursor is left open
+// DESC: Close a cursor opened by hm_iter_init
+void hm_iter_release(HMapIter *iter)
+{
+    if(!iter->hmap) return;
+
+    assert(iter->hmap->iterators > 0);
+    iter->hmap->iterators--;
+    iter->hmap = NULL;
+}
+
+// IN : HMap *hmap, size_t n
+// OUT : table sized for n keys, possibly with a migration started
+// DESC: Pre-size before a bulk load so it does not rehash repeatedly.
+//       A migration already in progress is finished first.
+void hm_reserve(HMap *hmap, size_t n)
+{
+    size_t want = slots_for(n);
+    if(!hmap->newMap.tab)
+    {
+        h_init(&hmap->newMap, want);
+        return;
+    }
+    if(want <= hmap->newMap.mask + 1 || hmap->iterators > 0) return;
+
+    while(hmap->oldMap.tab)
+    {
+        hm_migrate(hmap, hmap->oldMap.size);
+    }
+    hm_start_resize(hmap, want);
+}
+
+// IN : HMap *hmap, size_t max_work
+// OUT : returns true if there is still rehashing work left
+// DESC: Explicit rehashing step, e.g. from an idle event loop
+bool hm_rehash_step(HMap *hmap, size_t max_work)
+{
+    if(hmap->iterators > 0) return false;
+
+    hm_migrate(hmap, max_work);
+    hm_maybe_grow(hmap);
+    return hmap->oldMap.tab != NULL;
+}
+
+// IN : HMap *hmap
+// OUT : true if a migration is in progress and not paused by an iterator
+// DESC: Whether hm_rehash_step() has work to do
+bool hm_rehashing(HMap *hmap)
+{
+    return hmap->oldMap.tab != NULL && hmap->iterators == 0;
+}
+
+// IN : HMap *hmap
+// OUT : number of allocated slots in both tables
+// DESC: Table memory is hm_slots() * sizeof(HNode *)
+size_t hm_slots(HMap *hmap)
+{
+    size_t n = 0;
+    if(hmap->newMap.tab) n += hmap->newMap.mask + 1;
+    if(hmap->oldMap.tab) n += hmap->oldMap.mask + 1;
+    return n;
+}
\ No newline at end of file
@@ -22,10 +22,29 @@ struct HMap {
     HTab newMap;
     HTab oldMap;
     size_t migrate_pos = 0;
+    size_t iterators = 0;   // open HMapIter count; rehashing is paused while > 0
+};
+
+// Incremental cursor over every node in a HMap.
+// While a cursor is open, nodes never move between slots, so every node that
+// stays in the map for the whole walk is visited exactly once. Nodes inserted
+// or deleted during the walk may or may not be visited.
+struct HMapIter {
+    HMap *hmap = NULL;
+    size_t table = 0;   // 0: newMap, 1: oldMap, 2: done
+    size_t pos = 0;     // next slot to visit
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_clear(HMap *hmap);
-size_t hm_size(HMap *hmap);
\ No newline at end of file
+size_t hm_size(HMap *hmap);
+void   hm_reserve(HMap *hmap, size_t n);
+bool   hm_rehash_step(HMap *hmap, size_t max_work);
+bool   hm_rehashing(HMap *hmap);
+size_t hm_slots(HMap *hmap);
+
+void hm_iter_init(HMap *hmap, HMapIter *iter);
+bool hm_iter_next(HMapIter *iter, size_t max_work, void (*f)(HNode *, void *), void *arg);
+void hm_iter_release(HMapIter *iter);
\ No newline at end of file
@@ -0,0 +1,139 @@
+// HMap resizing benchmark: table memory and lookup latency through a
+// grow / mass delete / regrow cycle, with and without hm_reserve().
+//
+//   hashtable_bench [--keys N]
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "hashtable.h"
+
+#define container_of(ptr, T, member) \
+    ((T *)((char *)ptr - offsetof(T, member)))
+
+struct Item
+{
+    HNode node;
+    uint64_t key = 0;
+};
+
+static double now_sec()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t hash64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static bool item_eq(HNode *a, HNode *b)
+{
+    return container_of(a, Item, node)->key == container_of(b, Item, node)->key;
+}
+
+static void insert_range(HMap *map, std::vector<Item> &items, size_t lo, size_t hi)
+{
+    for(size_t i = lo ; i < hi ; ++i)
+    {
+        items[i].key = i;
+        items[i].node.hcode = hash64(i);
+        hm_insert(map, &items[i].node);
+    }
+}
+
+// average lookup time over the keys still present
+static double lookup_ns(HMap *map, size_t nkeys, size_t stride)
+{
+    const size_t rounds = 1000000;
+    Item probe;
+    size_t found = 0;
+    double t0 = now_sec();
+    for(size_t i = 0 ; i < rounds ; ++i)
+    {
+        probe.key = (i % nkeys) * stride;
+        probe.node.hcode = hash64(probe.key);
+        found += hm_lookup(map, &probe.node, &item_eq) != NULL;
+    }
+    double secs = now_sec() - t0;
+    if(found != rounds)
+    {
+        fprintf(stderr, "lookup missed %zu keys\n", rounds - found);
+        exit(1);
+    }
+    return secs * 1e9 / rounds;
+}
+
+static void report(const char *phase, HMap *map, double lookup, double secs)
+{
+    printf("%-22s %9zu keys %10zu slots %8.1f MB table %6.1f ns/lookup %8.1f ms\n",
+           phase, hm_size(map), hm_slots(map),
+           hm_slots(map) * sizeof(HNode *) / 1e6, lookup, secs * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 4000000;
+    for(int i = 1 ; i + 1 < argc ; i += 2)
+    {
+        if(!strcmp(argv[i], "--keys")) n = strtoull(argv[i + 1], NULL, 10);
+    }
+    const size_t stride = 100;  // keep 1 in 100 keys after the mass delete
+
+    std::vector<Item> items(n);
+    HMap map;
+
+    double t0 = now_sec();
+    insert_range(&map, items, 0, n);
+    double t = now_sec() - t0;
+    report("grow", &map, lookup_ns(&map, n, 1), t);
+
+    t0 = now_sec();
+    for(size_t i = 0 ; i < n ; ++i)
+    {
+        if(i % stride == 0) continue;
+        Item probe;
+        probe.key = i;
+        probe.node.hcode = hash64(i);
+        hm_delete(&map, &probe.node, &item_eq);
+    }
+    t = now_sec() - t0;
+    report("delete 99%", &map, lookup_ns(&map, n / stride, stride), t);
+
+    t0 = now_sec();
+    while(hm_rehash_step(&map, 1024)) {}
+    t = now_sec() - t0;
+    report("idle rehash", &map, lookup_ns(&map, n / stride, stride), t);
+
+    // regrow the deleted keys, then load a fresh table, with and without reserve
+    t0 = now_sec();
+    for(size_t i = 0 ; i < n ; ++i)
+    {
+        if(i % stride == 0) continue;
+        items[i].node.hcode = hash64(i);
+        hm_insert(&map, &items[i].node);
+    }
+    t = now_sec() - t0;
+    report("regrow", &map, lookup_ns(&map, n, 1), t);
+    hm_clear(&map);
+
+    t0 = now_sec();
+    insert_range(&map, items, 0, n);
+    t = now_sec() - t0;
+    report("load", &map, lookup_ns(&map, n, 1), t);
+    hm_clear(&map);
+
+    t0 = now_sec();
+    hm_reserve(&map, n);
+    insert_range(&map, items, 0, n);
+    t = now_sec() - t0;
+    report("load with reserve", &map, lookup_ns(&map, n, 1), t);
+    hm_clear(&map);
+    return 0;
+}
@@ -0,0 +1,143 @@
+// Pub/Sub fan-out benchmark with many subscribers of one channel.
+//
+//   pubsub_bench [--port N] [--subs N] [--rounds N] [--size BYTES]
+//
+// publish     : publisher-side latency of "publish" to every subscriber
+// no subs     : the same for a channel nobody listens to
+// unsubscribe : every subscriber sends "unsubscribe", until all are answered
+// disconnect  : every subscriber closes its socket, until "publish" reports
+//               no receivers left
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "client_lib.h"
+
+
+static double now_sec()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void call(int fd, const std::vector<std::string> &cmd, Reply &reply)
+{
+    if(send_req(fd, cmd) || read_res(fd, reply))
+    {
+        fprintf(stderr, "request failed\n");
+        exit(1);
+    }
+}
+
+// send cmd on every socket first, then read every reply
+static void call_all(const std::vector<int> &fds, const std::vector<std::string> &cmd)
+{
+    Reply reply;
+    for(int fd : fds)
+    {
+        if(send_req(fd, cmd))
+        {
+            fprintf(stderr, "send failed\n");
+            exit(1);
+        }
+    }
+    for(int fd : fds)
+    {
+        if(read_res(fd, reply))
+        {
+            fprintf(stderr, "read failed\n");
+            exit(1);
+        }
+    }
+}
+
+static void read_all(const std::vector<int> &fds)
+{
+    Reply reply;
+    for(int fd : fds)
+    {
+        if(read_res(fd, reply) || reply.status != RES_PUSH)
+        {
+            fprintf(stderr, "push missing\n");
+            exit(1);
+        }
+    }
+}
+
+// median publisher-side latency in ms
+static double publish_ms(int pub, const std::vector<int> &subs, const std::string &channel,
+                         const std::string &msg, size_t rounds)
+{
+    std::vector<double> ts;
+    Reply reply;
+    for(size_t r = 0 ; r < rounds ; ++r)
+    {
+        double t0 = now_sec();
+        call(pub, {"publish", channel, msg}, reply);
+        ts.push_back((now_sec() - t0) * 1e3);
+        read_all(subs);
+    }
+    std::sort(ts.begin(), ts.end());
+    return ts[ts.size() / 2];
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t port = 8080;
+    size_t nsubs = 10000;
+    size_t rounds = 20;
+    size_t size = 1024;
+    for(int i = 1 ; i + 1 < argc ; i += 2)
+    {
+        if(!strcmp(argv[i], "--port")) port = (uint16_t)atoi(argv[i + 1]);
+        else if(!strcmp(argv[i], "--subs")) nsubs = strtoull(argv[i + 1], NULL, 10);
+        else if(!strcmp(argv[i], "--rounds")) rounds = strtoull(argv[i + 1], NULL, 10);
+        else if(!strcmp(argv[i], "--size")) size = strtoull(argv[i + 1], NULL, 10);
+    }
+
+    int pub = tcp_connect("127.0.0.1", port);
+    std::vector<int> subs;
+    for(size_t i = 0 ; i < nsubs ; ++i)
+    {
+        int fd = tcp_connect("127.0.0.1", port);
+        if(fd < 0)
+        {
+            fprintf(stderr, "connect failed after %zu subscribers\n", i);
+            exit(1);
+        }
+        subs.push_back(fd);
+    }
+    if(pub < 0)
+    {
+        fprintf(stderr, "connect failed\n");
+        exit(1);
+    }
+
+    std::string msg(size, 'x');
+    Reply reply;
+    call_all(subs, {"subscribe", "bench"});
+    printf("%-12s %8zu subs  %8.3f ms\n", "publish", nsubs, publish_ms(pub, subs, "bench", msg, rounds));
+    printf("%-12s %8d subs  %8.3f ms\n", "no subs", 0, publish_ms(pub, {}, "nobody", msg, rounds));
+
+    double t0 = now_sec();
+    call_all(subs, {"unsubscribe"});
+    printf("%-12s %8zu subs  %8.3f ms\n", "unsubscribe", nsubs, (now_sec() - t0) * 1e3);
+
+    call_all(subs, {"subscribe", "bench"});
+    t0 = now_sec();
+    for(int fd : subs)
+    {
+        close(fd);
+    }
+    do
+    {
+        call(pub, {"publish", "bench", "x"}, reply);
+    } while(reply.data != "0");
+    printf("%-12s %8zu subs  %8.3f ms\n", "disconnect", nsubs, (now_sec() - t0) * 1e3);
+    close(pub);
+    return 0;
+}
@@ -5,19 +5,30 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
 // system
 #include <fcntl.h>
 #include <poll.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 // C++
 #include <string>
 #include <vector>
+#include <deque>
 #include <map>
+#include <set>
 // Project Lib
 #include "hashtable.h"
+#include "compress.h"
+#include "cluster.h"
+#include "bitops.h"
 
 #define container_of(ptr, T, member) \
     ((T *)((char *)ptr - offsetof(T, member)))
@@ -30,6 +41,100 @@ CONSTANTS AND OBJECT DECLARATIONS
 
 const size_t k_max_msg = 32 << 20; //33,554,432 bytes. should be larger than will be needed.
 const size_t k_max_args = 200 * 1000; //
+const size_t k_repl_backlog = 1 << 20;  // default replication backlog size
+const size_t k_repl_chunk = 64 * 1024;  // max snapshot bytes queued to a replica per loop iteration
+const size_t k_repl_out_limit = 256 << 20; // drop a replica with this much stream unsent
+const size_t k_repl_snapshot_work = 1;  // hash slots per iterator step, checked against k_repl_chunk
+const uint64_t k_repl_retry_ms = 1000;  // delay before reconnecting to the primary
+const uint64_t k_repl_stall_ms = 10 * 1000; // drop a replica whose snapshot stops draining
+const size_t k_max_iov = 64;             // iovecs per writev()
+const size_t k_req_budget = 128;         // requests per connection per loop iteration
+const size_t k_byte_budget = 256 * 1024; // request bytes per connection per loop iteration
+const size_t k_out_soft_limit = 1 << 20; // default: stop serving a conn above this much output
+const size_t k_out_hard_limit = 64 << 20; // default: disconnect above this much output
+const size_t k_stream_threshold = 128 * 1024; // requests and values at least this big are streamed
+const uint64_t k_idle_rehash_ns = 1000 * 1000; // rehashing time per idle loop iteration
+const size_t k_idle_rehash_work = 1024;  // nodes moved between clock checks
+const uint16_t k_no_node = 0xFFFF;       // cluster: slot not assigned
+const size_t k_migrate_window = 256;     // keys sent to the importing node but not acked
+const size_t k_tracking_max = 1 << 20;   // default: tracked (key, connection) pairs
+const size_t k_max_bitmap = k_max_msg - 64 * 1024; // bytes a setbit may grow a value to
+const size_t k_bitop_step = 256 * 1024;  // bitop result bytes computed per loop iteration
+const uint32_t k_bitop_max_restarts = 3; // then a bitop finishes without yielding
+
+//Connection roles.
+enum
+{
+    CONN_NORMAL  = 0,
+    CONN_REPLICA = 1, // a replica attached to us, we are its primary
+    CONN_MASTER  = 2, // our link to the primary, we are a replica
+    CONN_MIGRATE = 3, // our link to a node importing a slot from us
+};
+
+//Client tracking modes.
+enum
+{
+    TRACK_OFF     = 0,
+    TRACK_DEFAULT = 1, // invalidate keys this connection has read
+    TRACK_BCAST   = 2, // invalidate every key matching a prefix
+};
+
+//Replication link states.
+enum
+{
+    REPL_HANDSHAKE = 0, // sync sent, waiting for the primary's reply
+    REPL_SNAPSHOT  = 1, // initial snapshot in flight
+    REPL_ONLINE    = 2, // streaming the replication log
+};
+
+struct Channel;
+struct Pattern;
+struct BitopJob;
+
+// One side of a Pub/Sub subscription: the channel or pattern in
+// Conn::channels / Conn::patterns, or the connection in the subs of a
+// Channel / Pattern. pos is the index of the other side's SubRef, so a
+// subscription is removed from both vectors in O(1) by swap-and-pop.
+template <class T>
+struct SubRef
+{
+    T *ptr = NULL;
+    size_t pos = 0;
+};
+
+// Byte buffer referenced by the outgoing queues of several connections.
+// Pub/Sub serializes a message once and every subscriber queues a reference.
+struct RcBuf
+{
+    uint32_t refs = 0;
+    std::vector<uint8_t> data;
+};
+
+// A shared buffer queued on a connection. It goes out once the private
+// outgoing stream has been written up to byte `at`.
+struct OutRef
+{
+    uint64_t at = 0;
+    RcBuf *buf = NULL;
+    size_t pos = 0; // bytes of buf already written
+};
+
+// Incremental parser for large requests. Arguments are filled in place as
+// bytes arrive, instead of waiting for the whole message in Conn::incoming
+// and copying it out afterwards. An argument's buffer grows with the bytes
+// received, not with its length prefix, so a stalled header costs little.
+struct ReqStream
+{
+    bool active = false;
+    uint32_t len = 0;           // message length from the header
+    uint32_t body_left = 0;     // message bytes not consumed yet
+    uint32_t nstr = 0;
+    bool have_nstr = false;
+    bool in_arg = false;        // filling cmd.back()
+    size_t arg_len = 0;         // declared length of cmd.back()
+    size_t arg_filled = 0;      // bytes received; cmd.back().size() is the room allocated
+    std::vector<std::string> cmd;
+};
 
 struct Conn
 {
@@ -39,9 +144,37 @@ struct Conn
     bool want_read = false;
     bool want_write = false;
     bool want_close = false;
+    bool pending = false; // in g_data.pending: complete requests left unprocessed
 
     std::vector<uint8_t> incoming; // data to be parsed
+    ReqStream stream;              // large request being received
     std::vector<uint8_t> outgoing; // data to be sent
+    std::deque<OutRef> out_refs;   // shared buffers interleaved with outgoing
+    uint64_t out_sent = 0;         // bytes of outgoing written so far
+    size_t out_ref_bytes = 0;      // unsent bytes held by out_refs
+
+    //Pub/Sub.
+    std::vector<SubRef<Channel>> channels;
+    std::vector<SubRef<Pattern>> patterns;
+
+    //Replication.
+    int role = CONN_NORMAL;
+    int repl_state = REPL_HANDSHAKE;
+    std::vector<uint8_t> repl_buf; // CONN_REPLICA: stream not yet moved to outgoing
+    HMapIter snapshot;        // CONN_REPLICA: full sync cursor over g_data.db
+    uint64_t snapshot_ms = 0; // CONN_REPLICA: last time the snapshot advanced
+
+    //Cluster.
+    bool asking = false;      // the next command may use a slot being imported
+    int import_slot = -1;     // importing that slot for as long as conn is open
+
+    //Client tracking.
+    uint64_t id = 0;                    // unique per accepted connection
+    int tracking = TRACK_OFF;
+    std::vector<std::string> prefixes;  // TRACK_BCAST: empty matches every key
+
+    //Bitmaps.
+    BitopJob *bitop = NULL;   // running "bitop"; later requests wait for its reply
 };
 
 
@@ -51,26 +184,211 @@ enum
     RES_OK  = 0,
     RES_ERR = 1,
     RES_NX  = 2,
+    RES_PUSH = 3, // unsolicited message, data is a serialized string array
+    RES_MOVED = 4, // cluster: "<slot> <host:port>", the slot is served there
+    RES_ASK   = 5, // cluster: "<slot> <host:port>", retry once there after "asking"
 };
 
 struct Response
 {
     uint32_t status = 0;
     std::vector<uint8_t> data;
+    RcBuf *ref = NULL;  // large payload, queued by reference after data
 };
 
 //Top level hashtable
 static struct 
 {
     HMap db; 
+    // Map of all client connections, keyed by the fd.
+    std::vector<Conn *> fd2conn;
+    // Connections that ran out of budget, resumed round-robin.
+    std::deque<Conn *> pending;
+    // Pub/Sub: channel name -> Channel, and all pattern subscriptions.
+    HMap channels;
+    std::vector<Pattern *> patterns;
 } g_data;
 
+//Replication state. The stream is the serialized mutating requests applied
+//on the primary; offsets count bytes of that stream since startup.
+static struct
+{
+    char replid[41] = {};                 // identifies this primary's stream
+    size_t backlog_cap = k_repl_backlog;
+    std::vector<uint8_t> backlog;         // ring buffer, allocated on first sync
+    uint64_t offset = 0;                  // bytes ever written to the stream
+    std::vector<Conn *> replicas;
+
+    bool is_replica = false;
+    struct sockaddr_in master_addr = {};
+    Conn *master = NULL;
+    char master_replid[41] = "?";         // "?" until a full sync completes
+    char sync_replid[41] = {};            // replid of the full sync being loaded
+    uint64_t master_offset = 0;           // stream bytes applied from the primary
+    uint64_t next_connect_ms = 0;
+} g_repl;
+
+//Runtime configuration from the command line.
+static struct
+{
+    size_t out_soft_limit = k_out_soft_limit;
+    size_t out_hard_limit = k_out_hard_limit;
+    size_t compress_min = 0;    // compress values at least this big, 0 = off
+    int listen_backlog = SOMAXCONN;
+    int busy_poll_usec = 0;     // SO_BUSY_POLL on TCP client sockets, 0 = off
+    int sndbuf = 0;             // SO_SNDBUF on client sockets, 0 = kernel default
+    int rcvbuf = 0;             // SO_RCVBUF on client sockets, 0 = kernel default
+    size_t tracking_max = k_tracking_max;
+} g_config;
+
+//Cluster state. Slots map to indexes in nodes; node 0 is this process.
+//The assignment is static: given on the command line or with "cluster
+//setslot", and changed by live migration between two nodes.
+static struct
+{
+    bool enabled = false;
+    std::string announce_host = "127.0.0.1";
+    std::vector<std::string> nodes;         // "host:port"
+    uint16_t owner[k_cluster_slots];        // k_no_node: not served
+    uint16_t migrating[k_cluster_slots];    // owned here, keys moving to that node
+    uint16_t importing[k_cluster_slots];    // keys arriving from that node
+    uint32_t keys[k_cluster_slots];         // keys stored here, per slot
+} g_cluster;
+
+//Messages on the migration link, matched to replies in order.
+enum
+{
+    MIG_SETUP  = 0, // cluster setslot <slot> importing <us>
+    MIG_ASKING = 1,
+    MIG_SET    = 2,
+    MIG_DEL    = 3,
+    MIG_FINISH = 4, // cluster setslot <slot> node <target>
+};
+
+struct MigrateOp
+{
+    int kind = MIG_SETUP;
+    std::string key;
+};
+
+//Live migration of one slot to another node. Keys are read with an HMap
+//iterator and sent over a CONN_MIGRATE link, and deleted here once the
+//target acknowledges them. A key written here while its copy is in flight
+//is marked dirty and sent again; until then it is served here, not on the
+//target.
+static struct
+{
+    bool active = false;
+    uint16_t slot = 0;
+    uint16_t target = 0;                        // index in g_cluster.nodes
+    struct sockaddr_in addr = {};
+    Conn *link = NULL;
+    HMapIter iter;
+    bool scanning = false;                      // iter is open
+    bool finishing = false;                     // MIG_FINISH sent
+    bool linked = false;                        // the target acked MIG_SETUP
+    bool aborted = false;                       // the target may hold keys of slot
+    std::deque<MigrateOp> ops;                  // sent, waiting for a reply
+    std::map<std::string, uint32_t> inflight;   // key -> set/del not acked yet
+    std::set<std::string> dirty;                // written while in flight or aborted
+    uint64_t moved = 0;
+} g_migrate;
+
+// A connection that read a tracked key. Connections are not unregistered
+// when they close; the id tells a reused fd apart.
+struct TrackRef
+{
+    int fd = -1;
+    uint64_t id = 0;
+};
+
+// A key read by tracking connections since it last changed
+struct TrackedKey
+{
+    struct HNode node;
+    std::string key;
+    std::vector<TrackRef> refs;
+};
+
+//Client tracking state. Memory is bounded by g_config.tracking_max refs;
+//beyond that every default-mode client is told to flush its cache.
+static struct
+{
+    HMap keys;                  // TrackedKey, by key
+    size_t nrefs = 0;           // refs over all keys
+    std::vector<Conn *> bcast;  // connections in TRACK_BCAST
+    uint64_t next_id = 1;       // Conn::id
+    uint64_t invalidations = 0; // push messages queued
+    uint64_t flushes = 0;       // flush-all invalidations
+} g_track;
+
+// A "bitop" whose result is computed k_bitop_step bytes per loop iteration.
+// Sources are read in place; a write to one of them starts the job over.
+struct BitopJob
+{
+    Conn *conn = NULL;
+    std::vector<std::string> cmd;       // bitop <op> <dest> <src>...
+    int op = BIT_AND;
+    std::vector<const uint8_t *> src;   // per source: its bytes, NULL if missing
+    std::vector<size_t> src_len;
+    std::vector<std::string> plain;     // decompressed copies of LZ4 sources
+    size_t len = 0;                     // result length: the longest source
+    std::string result;                 // computed so far
+    bool restart = false;               // a source was written
+    uint32_t restarts = 0;
+};
+
+//Bitmap operations in progress.
+static struct
+{
+    std::vector<BitopJob *> jobs;
+    uint64_t restarts = 0;
+} g_bitop;
+
+//Counters reported by the "stats" command.
+static struct
+{
+    uint64_t compress_calls = 0;    // values that were tried
+    uint64_t compress_kept = 0;     // ... and stored compressed
+    uint64_t compress_nsec = 0;
+    uint64_t decompress_calls = 0;
+    uint64_t decompress_nsec = 0;
+    size_t lz4_values = 0;          // live compressed values
+    size_t lz4_raw_bytes = 0;       // their uncompressed size
+    size_t lz4_stored_bytes = 0;    // their compressed size
+} g_stats;
+
+//Value encodings.
+enum
+{
+    ENC_RAW = 0,
+    ENC_LZ4 = 1,
+};
+
 // KV pair for the HT above
 struct Entry
 {
     struct HNode node;
     std::string key;
-    std::string val;
+    std::string val;        // raw bytes, or an LZ4 block when enc == ENC_LZ4
+    uint8_t enc = ENC_RAW;
+    uint16_t slot = 0;      // cluster hash slot, set in cluster mode
+    uint32_t raw_len = 0;   // uncompressed size when enc == ENC_LZ4
+};
+
+// Pub/Sub channel and its subscribers, stored in g_data.channels
+struct Channel
+{
+    struct HNode node;
+    std::string name;
+    std::vector<SubRef<Conn>> subs;
+};
+
+// Pattern subscription, matched against every published channel
+struct Pattern
+{
+    std::string pattern;
+    std::vector<SubRef<Conn>> subs;
 };
 
 /*
@@ -127,6 +445,31 @@ static void fd_set_nb(int fd)
     }
 }
 
+// IN : int fd, bool tcp
+// OUT : none
+// DESC: Apply the configured options to a connection socket. Nagle is always
+//       off on TCP: every reply is written whole and must not wait for an ACK.
+static void fd_set_sockopts(int fd, bool tcp)
+{
+    int val = 1;
+    if(tcp)
+    {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    }
+    if(tcp && g_config.busy_poll_usec > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &g_config.busy_poll_usec, sizeof(int));
+    }
+    if(g_config.sndbuf > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &g_config.sndbuf, sizeof(int));
+    }
+    if(g_config.rcvbuf > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &g_config.rcvbuf, sizeof(int));
+    }
+}
+
 // IN : HNode *lhs, HNode *rhs
 // OUT : bool
 // DESC: Compare two Entry nodes by their key for equality
@@ -150,310 +493,3046 @@ static uint64_t str_hash(const uint8_t *data, size_t len)
     return h;
 }
 
-// IN : std::vector<std::string> &cmd, Response &out
-// OUT : Response is updated with the value if key exists, or status=RES_NX if not found
-// DESC: Handle a "get" command by looking up the key in the hash table
-static void do_get(std::vector<std::string> &cmd, Response &out)
+// IN : std::vector<uint8_t> &buf, const uint8_t *data, size_t len
+// OUT : buf is appended with the new data
+// DESC: Append a byte array to the end of a buffer
+static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    buf.insert(buf.end(), data, data + len);
+}
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if(!node)
-    {
-        out.status = RES_NX;
-        return;
-    }
+// IN : std::vector<uint8_t> &buf, size_t n
+// OUT : buf has the first n bytes removed
+// DESC: Remove the first n bytes from a buffer
+static void buf_remove(std::vector<uint8_t> &buf, size_t n)
+{
+    buf.erase(buf.begin(), buf.begin() + n);
+}
 
-    const std::string &val = container_of(node, Entry, node)->val;
-    assert(val.size() <= k_max_msg);
-    out.data.assign(val.begin(), val.end());
+// IN : std::vector<uint8_t> &buf, uint32_t data
+// OUT : buf is appended with 4 bytes
+// DESC: Append a little endian 32-bit integer to a buffer
+static void buf_append_u32(std::vector<uint8_t> &buf, uint32_t data)
+{
+    buf_append(buf, (const uint8_t *)&data, 4);
 }
 
-// IN : std::vector<std::string> &cmd, Response &out
-// OUT : Response is updated indirectly by updating the HT
-// DESC: Handle a "set" command by inserting or updating the key-value pair in the hash table
-static void do_set(std::vector<std::string> &cmd, Response &)
+// IN : std::vector<uint8_t> &buf, const std::string &s
+// OUT : buf is appended with the length-prefixed string
+// DESC: Append one request argument (len + bytes) to a buffer
+static void buf_append_str(std::vector<uint8_t> &buf, const std::string &s)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    buf_append_u32(buf, (uint32_t)s.size());
+    buf_append(buf, (const uint8_t *)s.data(), s.size());
+}
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) 
-    {
-        container_of(node, Entry, node)->val.swap(cmd[2]);
-    } 
-    else 
+// IN : const std::vector<std::string> &cmd
+// OUT : size of the request body (without the 4 byte length header)
+// DESC: Compute the serialized size of a request
+static uint32_t cmd_size(const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for(const std::string &s : cmd)
     {
-        Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->val.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+        len += 4 + (uint32_t)s.size();
     }
+    return len;
 }
 
-// IN : std::vector<std::string> &cmd, Response &out
-// OUT : Response is updated indirectly by removing the key from the hash table
-// DESC: Handle a "del" command by deleting the key-value pair from the hash table
-static void do_del(std::vector<std::string> &cmd, Response &)
+// IN : std::vector<uint8_t> &buf, const std::vector<std::string> &cmd
+// OUT : buf is appended with a complete request message
+// DESC: Serialize a command in the same format clients send it
+static void buf_append_cmd(std::vector<uint8_t> &buf, const std::vector<std::string> &cmd)
 {
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-
-    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        delete container_of(node, Entry, node);
+    buf_append_u32(buf, cmd_size(cmd));
+    buf_append_u32(buf, (uint32_t)cmd.size());
+    for(const std::string &s : cmd)
+    {
+        buf_append_str(buf, s);
     }
 }
 
-// IN : std::vector<uint8_t> &buf, const uint8_t *data, size_t len
-// OUT : buf is appended with the new data
-// DESC: Append a byte array to the end of a buffer
-static void buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len)
+// IN : none
+// OUT : milliseconds from an arbitrary fixed point
+// DESC: Read the monotonic clock
+static uint64_t get_monotonic_msec()
 {
-    buf.insert(buf.end(), data, data + len);
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
-// IN : std::vector<uint8_t> &buf, size_t n
-// OUT : buf has the first n bytes removed
-// DESC: Remove the first n bytes from a buffer
-static void buf_remove(std::vector<uint8_t> &buf, size_t n)
+// IN : none
+// OUT : nanoseconds from an arbitrary fixed point
+// DESC: Read the monotonic clock, for timing short operations
+static uint64_t get_monotonic_nsec()
 {
-    buf.erase(buf.begin(), buf.begin() + n);
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
 }
 
-// IN : int fd
-// OUT : Conn * for the new client, or NULL on failure
-// DESC: Accept a new connection on the listening socket and initialize a Conn struct
-static Conn *handle_accept(int fd)
+// IN : const uint8_t *data, size_t len
+// OUT : bytes appended to the backlog ring, g_repl.offset advanced
+// DESC: Write raw bytes into the replication stream
+static void repl_backlog_write(const uint8_t *data, size_t len)
 {
-    struct sockaddr_in client_addr = {};
-    socklen_t addrlen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &addrlen);
-    if(connfd < 0)
+    size_t cap = g_repl.backlog.size();
+    while(len > 0)
     {
-        msg_errno("accept() error");
-        return NULL;
+        size_t pos = g_repl.offset % cap;
+        size_t n = len < cap - pos ? len : cap - pos;
+        memcpy(&g_repl.backlog[pos], data, n);
+        g_repl.offset += n;
+        data += n;
+        len -= n;
     }
-
-    uint32_t ip = client_addr.sin_addr.s_addr;
-    fprintf(stderr, "New Client from %u.%u.%u.%u.%u\n",
-            ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
-            ntohs(client_addr.sin_port));
-
-    fd_set_nb(connfd);
-
-    Conn *conn = new Conn();
-    conn->fd = connfd;
-    conn->want_read = true;
-    return conn;
 }
 
-// IN : const uint8_t *&cur, const uint8_t *end, uint32_t out
-// OUT : bool indicating success, out updated
-// DESC: Read a 32-bit unsigned integer from the buffer and advance the pointer
-static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t out)
+// IN : uint32_t data
+// OUT : 4 bytes appended to the backlog ring
+// DESC: Write a little endian 32-bit integer into the replication stream
+static void repl_backlog_u32(uint32_t data)
 {
-    if(cur + 4 > end) return false;
-    memcpy(&out, cur, 4);
-    cur += 4;
-    return true;
+    repl_backlog_write((const uint8_t *)&data, 4);
 }
 
-// IN : const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out
-// OUT : bool indicating success, out updated
-// DESC: Read n bytes from buffer into a string and advance the pointer
-static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out)
+// IN : none
+// OUT : lowest stream offset still held by the backlog
+// DESC: Anything below this offset needs a full resync
+static uint64_t repl_backlog_start()
 {
-    if(cur + n > end) return false;
-    out.assign(cur, cur + n);
-    cur += n;
-    return true;
+    size_t cap = g_repl.backlog.size();
+    return g_repl.offset > cap ? g_repl.offset - cap : 0;
 }
 
-// IN : const uint8_t *data, size_t size, std::vector<std::string> &out
-// OUT : returns 0 on success, -1 on failure; out populated with parsed strings
-// DESC: Parse a request message into individual string arguments
-static int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out)
+// IN : uint64_t from, std::vector<uint8_t> &out
+// OUT : the stream from offset `from` up to g_repl.offset appended to out
+// DESC: Read back the backlog for a partial resync
+static void repl_backlog_read(uint64_t from, std::vector<uint8_t> &out)
 {
-    const uint8_t *end = data + size;
-    uint32_t nstr = 0;
-
-    if(!read_u32(data, end, nstr)) return -1;
-    if(nstr > k_max_args) return -1;
-
-    while(out.size() < nstr)
+    size_t cap = g_repl.backlog.size();
+    while(from < g_repl.offset)
     {
-        uint32_t len = 0;
-        if(!read_u32(data, end, len)) return -1;
-
-        out.push_back(std::string());
-        if(!read_str(data, end, len, out.back())) return -1;
+        size_t pos = from % cap;
+        uint64_t n = g_repl.offset - from;
+        if(n > cap - pos) n = cap - pos;
+        buf_append(out, &g_repl.backlog[pos], (size_t)n);
+        from += n;
     }
-
-    if(data != end) return -1;
-    return 0;
 }
 
-// IN : std::vector<std::string> &cmd, Response &out
-// OUT : Response updated according to command
-// DESC: Dispatch a parsed request to the appropriate handler (get/set/del)
-static void do_request(std::vector<std::string> &cmd, Response &out)
+// IN : const std::vector<std::string> &cmd
+// OUT : cmd appended to the replication stream and to every replica's buffer
+// DESC: Record a mutating command; a no-op until the first replica attaches.
+//       The backlog only serves partial resyncs; each replica is sent the
+//       stream from its own buffer, so one large write or a burst of them
+//       does not push it out.
+static void repl_feed(const std::vector<std::string> &cmd)
 {
-    if(cmd.size() == 2 && cmd[0] == "get")
-    {
-        return do_get(cmd, out);
-    }
-    else if(cmd.size() == 3 && cmd[0] == "set")
-    {
-        return do_set(cmd, out);
-    }
-    else if(cmd.size() == 2 && cmd[0] == "del")
+    if(g_repl.is_replica || g_repl.backlog.empty()) return;
+
+    repl_backlog_u32(cmd_size(cmd));
+    repl_backlog_u32((uint32_t)cmd.size());
+    for(const std::string &s : cmd)
     {
-        return do_del(cmd, out);
+        repl_backlog_u32((uint32_t)s.size());
+        repl_backlog_write((const uint8_t *)s.data(), s.size());
     }
-    else
+
+    // repl_buf holds what must go out first: the snapshot's tail, or the
+    // backlog of a partial resync; repl_update() moves it to outgoing
+    for(Conn *conn : g_repl.replicas)
     {
-        out.status = RES_ERR;
+        if(conn->repl_state == REPL_ONLINE && conn->repl_buf.empty())
+        {
+            buf_append_cmd(conn->outgoing, cmd);
+            conn->want_write = true;
+        }
+        else
+        {
+            buf_append_cmd(conn->repl_buf, cmd);
+        }
     }
 }
 
-// IN : const Response &resp, std::vector<uint8_t> &out
-// OUT : out buffer contains serialized response
-// DESC: Convert Response struct into a byte buffer to send to client
-static void make_response(const Response &resp, std::vector<uint8_t> &out)
-{
-    uint32_t resp_len = 4 + (uint32_t)resp.data.size();
-    buf_append(out, (const uint8_t *)&resp_len, 4);
-    buf_append(out, (const uint8_t *)&resp.status, 4);
-    buf_append(out, resp.data.data(), resp.data.size());
-}
-
-// IN : Conn *conn
-// OUT : returns true if a request was processed; updates conn buffers and Response
-// DESC: Try to process one complete request from the connection buffer
-static bool try_one_request(Conn *conn)
+// IN : Entry *ent
+// OUT : g_stats no longer counts ent's value
+// DESC: Forget the compression accounting of a value about to go away
+static void entry_stats_remove(Entry *ent)
 {
-    if(conn->incoming.size() < 4)
+    if(ent->enc == ENC_LZ4)
     {
-        return false;
+        g_stats.lz4_values--;
+        g_stats.lz4_raw_bytes -= ent->raw_len;
+        g_stats.lz4_stored_bytes -= ent->val.size();
     }
+}
 
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
+// IN : Entry *ent, std::string &val
+// OUT : ent holds val, compressed if that saves at least 1/8
+// DESC: Store a new value; val is swapped out (left with the old value)
+static void entry_store(Entry *ent, std::string &val)
+{
+    entry_stats_remove(ent);
+    ent->val.swap(val);
+    ent->enc = ENC_RAW;
+    ent->raw_len = 0;
 
-    if(len > k_max_msg)
+    size_t n = ent->val.size();
+    if(g_config.compress_min == 0 || n < g_config.compress_min)
     {
-        msg("MSG too long.");
-        conn->want_close = true;
-        return false;
+        return;
     }
 
-    if(4 + len > conn->incoming.size())
+    // reuse a scratch buffer for common sizes, don't keep huge ones around
+    static std::vector<uint8_t> scratch;
+    std::vector<uint8_t> big;
+    size_t cap = n - n / 8;
+    std::vector<uint8_t> &tmp = cap <= (1 << 20) ? scratch : big;
+    if(tmp.size() < cap)
     {
-        return false;
+        tmp.resize(cap);
     }
 
-    const uint8_t *request = &conn->incoming[4];
-
-    std::vector<std::string> cmd;
-    if(parse_req(request, len, cmd) < 0)
+    uint64_t t0 = get_monotonic_nsec();
+    size_t m = lz4_compress((const uint8_t *)ent->val.data(), n, tmp.data(), cap);
+    g_stats.compress_nsec += get_monotonic_nsec() - t0;
+    g_stats.compress_calls++;
+    if(m == 0)
     {
-        msg("bad request");
-        conn->want_close = true;
-        return false;
+        return;     // did not pay off
     }
 
-    Response resp;
-    do_request(cmd, resp);
-    make_response(resp, conn->outgoing);
-
-    buf_remove(conn->incoming, 4 + len);
+    // a fresh string so the raw buffer is released
+    std::string((const char *)tmp.data(), m).swap(ent->val);
+    ent->enc = ENC_LZ4;
+    ent->raw_len = (uint32_t)n;
+    g_stats.compress_kept++;
+    g_stats.lz4_values++;
+    g_stats.lz4_raw_bytes += n;
+    g_stats.lz4_stored_bytes += m;
+}
 
-    return true;
+// IN : Entry *ent
+// OUT : size of the value as clients see it
+// DESC: Uncompressed value length
+static size_t entry_raw_size(Entry *ent)
+{
+    return ent->enc == ENC_LZ4 ? ent->raw_len : ent->val.size();
 }
 
-// IN : Conn *conn
-// OUT : updates conn->outgoing buffer and intent flags
-// DESC: Write buffered data to the client socket
-static void handle_write(Conn *conn)
+// IN : Entry *ent, uint8_t *dst
+// OUT : entry_raw_size(ent) bytes written to dst
+// DESC: Copy out the uncompressed value
+static void entry_read(Entry *ent, uint8_t *dst)
 {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
-    if(rv < 0 && errno == EAGAIN)
+    if(ent->enc == ENC_RAW)
     {
+        memcpy(dst, ent->val.data(), ent->val.size());
         return;
     }
-    if(rv < 0)
+
+    uint64_t t0 = get_monotonic_nsec();
+    bool ok = lz4_decompress((const uint8_t *)ent->val.data(), ent->val.size(), dst, ent->raw_len);
+    assert(ok);
+    (void)ok;
+    g_stats.decompress_nsec += get_monotonic_nsec() - t0;
+    g_stats.decompress_calls++;
+}
+
+// IN : Entry *ent
+// OUT : ent freed
+// DESC: Free an entry already removed from the db
+static void entry_destroy(Entry *ent)
+{
+    entry_stats_remove(ent);
+    if(g_cluster.enabled)
+    {
+        g_cluster.keys[ent->slot]--;
+    }
+    delete ent;
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : Response is updated with the value if key exists, or status=RES_NX if not found
+// DESC: Handle a "get" command by looking up the key in the hash table
+static void do_get(std::vector<std::string> &cmd, Response &out)
+{
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if(!node)
+    {
+        out.status = RES_NX;
+        return;
+    }
+
+    Entry *ent = container_of(node, Entry, node);
+    size_t size = entry_raw_size(ent);
+    assert(size <= k_max_msg);
+    if(size >= k_stream_threshold || ent->enc != ENC_RAW)
+    {
+        // one copy (or decompression) straight into the buffer that is
+        // queued on the connection and written out as the socket drains
+        out.ref = new RcBuf();
+        out.ref->data.resize(size);
+        entry_read(ent, out.ref->data.data());
+        return;
+    }
+    out.data.assign(ent->val.begin(), ent->val.end());
+}
+
+// IN : std::string &key, std::string &val
+// OUT : the entry now holding val
+// DESC: Insert or overwrite a key; key and val are swapped out
+static Entry *db_put(std::string &key, std::string &val)
+{
+    Entry probe;
+    probe.key.swap(key);
+    probe.node.hcode = str_hash((uint8_t *)probe.key.data(), probe.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &probe.node, &entry_eq);
+    if (node) 
+    {
+        Entry *ent = container_of(node, Entry, node);
+        entry_store(ent, val);
+        return ent;
+    } 
+
+    Entry *ent = new Entry();
+    ent->key.swap(probe.key);
+    ent->node.hcode = probe.node.hcode;
+    entry_store(ent, val);
+    if(g_cluster.enabled)
+    {
+        ent->slot = key_slot((const uint8_t *)ent->key.data(), ent->key.size());
+        g_cluster.keys[ent->slot]++;
+    }
+    hm_insert(&g_data.db, &ent->node);
+    return ent;
+}
+
+// IN : const std::string &key
+// OUT : returns true if key existed
+// DESC: Remove a key and free its entry
+static bool db_remove(const std::string &key)
+{
+    Entry probe;
+    probe.key = key;
+    probe.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+
+    HNode *node = hm_delete(&g_data.db, &probe.node, &entry_eq);
+    if (node) {
+        entry_destroy(container_of(node, Entry, node));
+    }
+    return node != NULL;
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : Response is updated indirectly by updating the HT
+// DESC: Handle a "set" command by inserting or updating the key-value pair in the hash table
+static void do_set(std::vector<std::string> &cmd, Response &)
+{
+    repl_feed(cmd);
+    db_put(cmd[1], cmd[2]);
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : Response is updated indirectly by removing the key from the hash table
+// DESC: Handle a "del" command by deleting the key-value pair from the hash table
+static void do_del(std::vector<std::string> &cmd, Response &)
+{
+    repl_feed(cmd);
+    db_remove(cmd[1]);
+}
+
+// IN : const std::string &key
+// OUT : running bitop jobs that read key start over
+// DESC: Called on every write to a key
+static void bitop_touch(const std::string &key)
+{
+    for(BitopJob *job : g_bitop.jobs)
+    {
+        for(size_t i = 3 ; i < job->cmd.size() ; ++i)
+        {
+            if(job->cmd[i] == key)
+            {
+                job->restart = true;
+                break;
+            }
+        }
+    }
+}
+
+// IN : HNode *node, void *arg
+// OUT : the Entry owning node is freed
+// DESC: Iterator callback used to free every entry of the db
+static void entry_del_cb(HNode *node, void *)
+{
+    entry_destroy(container_of(node, Entry, node));
+}
+
+// IN : none
+// OUT : g_data.db is empty
+// DESC: Free all key-value pairs; used before loading a full resync
+static void db_clear()
+{
+    HMapIter iter;
+    hm_iter_init(&g_data.db, &iter);
+    while(hm_iter_next(&iter, (size_t)-1, &entry_del_cb, NULL)) {}
+    hm_iter_release(&iter);
+    hm_clear(&g_data.db);
+}
+
+// IN : Response &out, const std::string &s
+// OUT : out.data holds s
+// DESC: Set a plain text response payload
+static void resp_str(Response &out, const std::string &s)
+{
+    out.data.assign(s.begin(), s.end());
+}
+
+// IN : Conn *conn, Response &out
+// OUT : returns false and fills out with an error if writes are not allowed
+// DESC: Replicas are read-only except for the stream from their primary
+static bool check_writable(Conn *conn, Response &out)
+{
+    if(g_repl.is_replica && conn->role != CONN_MASTER)
+    {
+        out.status = RES_ERR;
+        resp_str(out, "READONLY replica");
+        return false;
+    }
+    return true;
+}
+
+// IN : Response &out
+// OUT : out holds "name:value" lines
+// DESC: Handle "stats": key count, table sizes, tracking, bitmaps and compression ratio / CPU cost
+static void do_stats(Response &out)
+{
+    double ratio = g_stats.lz4_stored_bytes
+        ? (double)g_stats.lz4_raw_bytes / (double)g_stats.lz4_stored_bytes : 0.0;
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+        "keys:%zu\n"
+        "db_slots:%zu\n"
+        "db_rehashing:%d\n"
+        "channel_slots:%zu\n"
+        "tracking_keys:%zu\n"
+        "tracking_refs:%zu\n"
+        "tracking_bcast_clients:%zu\n"
+        "tracking_invalidations:%llu\n"
+        "tracking_flushes:%llu\n"
+        "bitmap_kernels:%s\n"
+        "bitop_jobs:%zu\n"
+        "bitop_restarts:%llu\n"
+        "compress_min:%zu\n"
+        "compressed_values:%zu\n"
+        "compressed_raw_bytes:%zu\n"
+        "compressed_stored_bytes:%zu\n"
+        "compression_ratio:%.2f\n"
+        "compress_calls:%llu\n"
+        "compress_kept:%llu\n"
+        "compress_usec:%llu\n"
+        "decompress_calls:%llu\n"
+        "decompress_usec:%llu\n",
+        hm_size(&g_data.db),
+        hm_slots(&g_data.db),
+        (int)hm_rehashing(&g_data.db),
+        hm_slots(&g_data.channels),
+        hm_size(&g_track.keys),
+        g_track.nrefs,
+        g_track.bcast.size(),
+        (unsigned long long)g_track.invalidations,
+        (unsigned long long)g_track.flushes,
+        bitops_backend(),
+        g_bitop.jobs.size(),
+        (unsigned long long)g_bitop.restarts,
+        g_config.compress_min,
+        g_stats.lz4_values,
+        g_stats.lz4_raw_bytes,
+        g_stats.lz4_stored_bytes,
+        ratio,
+        (unsigned long long)g_stats.compress_calls,
+        (unsigned long long)g_stats.compress_kept,
+        (unsigned long long)(g_stats.compress_nsec / 1000),
+        (unsigned long long)g_stats.decompress_calls,
+        (unsigned long long)(g_stats.decompress_nsec / 1000));
+    resp_str(out, buf);
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : conn becomes a replica, out holds FULLRESYNC or CONTINUE
+// DESC: Handle "sync <replid> <offset>" from a replica. A partial resync is
+//       granted when the requested offset is still in the backlog.
+static void do_sync(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    if(g_repl.is_replica || conn->role != CONN_NORMAL)
+    {
+        out.status = RES_ERR;
+        resp_str(out, "sync not allowed");
+        return;
+    }
+
+    if(g_repl.backlog.empty())
+    {
+        g_repl.backlog.resize(g_repl.backlog_cap);
+    }
+
+    char *end = NULL;
+    uint64_t want = strtoull(cmd[2].c_str(), &end, 10);
+    bool offset_ok = end && *end == '\0' && !cmd[2].empty();
+
+    conn->role = CONN_REPLICA;
+    g_repl.replicas.push_back(conn);
+
+    if(offset_ok && cmd[1] == g_repl.replid
+        && want >= repl_backlog_start() && want <= g_repl.offset)
+    {
+        conn->repl_state = REPL_ONLINE;
+        resp_str(out, "CONTINUE");
+        repl_backlog_read(want, conn->repl_buf);
+        fprintf(stderr, "Replica attached, partial resync from %llu\n",
+                (unsigned long long)want);
+        return;
+    }
+
+    // The snapshot is taken while the loop keeps serving writes. Every write
+    // made after this point is also queued in repl_buf, and replaying it over
+    // the snapshot converges to the primary's state.
+    conn->repl_state = REPL_SNAPSHOT;
+    conn->snapshot_ms = get_monotonic_msec();
+    hm_iter_init(&g_data.db, &conn->snapshot);
+    // the key count lets the replica size its table before loading
+    resp_str(out, "FULLRESYNC " + std::string(g_repl.replid) + " "
+                  + std::to_string(g_repl.offset) + " "
+                  + std::to_string(hm_size(&g_data.db)));
+    fprintf(stderr, "Replica attached, full resync at %llu\n",
+            (unsigned long long)g_repl.offset);
+}
+
+// IN : RcBuf *buf
+// OUT : buf freed when the last reference is dropped
+// DESC: Drop one reference to a shared buffer
+static void rcbuf_unref(RcBuf *buf)
+{
+    assert(buf->refs > 0);
+    if(--buf->refs == 0)
+    {
+        delete buf;
+    }
+}
+
+// IN : Conn *conn
+// OUT : number of bytes waiting to be written
+// DESC: Size of the private outgoing buffer plus queued shared buffers
+static size_t conn_out_size(Conn *conn)
+{
+    return conn->outgoing.size() + conn->out_ref_bytes;
+}
+
+// IN : Conn *conn, RcBuf *buf
+// OUT : buf queued after everything already in the outgoing stream
+// DESC: Queue a shared buffer by reference instead of copying it
+static void conn_queue_ref(Conn *conn, RcBuf *buf)
+{
+    OutRef ref;
+    ref.at = conn->out_sent + conn->outgoing.size();
+    ref.buf = buf;
+    buf->refs++;
+    conn->out_refs.push_back(ref);
+    conn->out_ref_bytes += buf->data.size();
+    conn->want_write = true;
+
+    if(conn->role == CONN_NORMAL && conn_out_size(conn) > g_config.out_hard_limit
+        && !conn->want_close)
+    {
+        msg("Output buffer hard limit reached, closing.");
+        conn->want_close = true;
+    }
+}
+
+// IN : Conn *conn, size_t n
+// OUT : n written bytes removed from the outgoing stream
+// DESC: Advance the private buffer and shared buffers in stream order
+static void conn_out_consume(Conn *conn, size_t n)
+{
+    while(n > 0)
+    {
+        if(!conn->out_refs.empty() && conn->out_refs.front().at == conn->out_sent)
+        {
+            OutRef &ref = conn->out_refs.front();
+            size_t k = ref.buf->data.size() - ref.pos;
+            if(k > n) k = n;
+            ref.pos += k;
+            conn->out_ref_bytes -= k;
+            n -= k;
+            if(ref.pos == ref.buf->data.size())
+            {
+                rcbuf_unref(ref.buf);
+                conn->out_refs.pop_front();
+            }
+            continue;
+        }
+
+        size_t k = conn->outgoing.size();
+        if(!conn->out_refs.empty() && conn->out_refs.front().at - conn->out_sent < k)
+        {
+            k = (size_t)(conn->out_refs.front().at - conn->out_sent);
+        }
+        if(k > n) k = n;
+        buf_remove(conn->outgoing, k);
+        conn->out_sent += k;
+        n -= k;
+    }
+}
+
+// IN : const std::vector<const std::string *> &strs
+// OUT : new RcBuf holding a complete RES_PUSH response frame
+// DESC: Serialize a push message once so it can be shared by many connections
+static RcBuf *push_new(const std::vector<const std::string *> &strs)
+{
+    uint32_t len = 4 + 4;
+    for(const std::string *s : strs)
+    {
+        len += 4 + (uint32_t)s->size();
+    }
+
+    RcBuf *buf = new RcBuf();
+    buf->data.reserve(4 + len);
+    buf_append_u32(buf->data, len);
+    buf_append_u32(buf->data, RES_PUSH);
+    buf_append_u32(buf->data, (uint32_t)strs.size());
+    for(const std::string *s : strs)
+    {
+        buf_append_str(buf->data, *s);
+    }
+    return buf;
+}
+
+// IN : const char *pat, const char *pend, const char *str, const char *send
+// OUT : true if str matches the glob pattern
+// DESC: Glob match supporting *, ?, [set], [^set], [a-z] and \ escapes
+static bool glob_match(const char *pat, const char *pend, const char *str, const char *send)
+{
+    const char *star_pat = NULL;
+    const char *star_str = NULL;
+    while(str < send)
+    {
+        if(pat < pend && *pat == '*')
+        {
+            star_pat = ++pat;
+            star_str = str;
+            continue;
+        }
+
+        bool ok = false;
+        const char *next = pat + 1;
+        if(pat < pend && *pat == '?')
+        {
+            ok = true;
+        }
+        else if(pat < pend && *pat == '[')
+        {
+            const char *p = pat + 1;
+            bool negate = p < pend && *p == '^';
+            if(negate) p++;
+            bool hit = false;
+            while(p < pend && *p != ']')
+            {
+                if(*p == '\\' && p + 1 < pend)
+                {
+                    p++;
+                }
+                if(p + 2 < pend && p[1] == '-' && p[2] != ']')
+                {
+                    char lo = p[0], hi = p[2];
+                    if(lo > hi) { char t = lo; lo = hi; hi = t; }
+                    hit |= *str >= lo && *str <= hi;
+                    p += 3;
+                }
+                else
+                {
+                    hit |= *p == *str;
+                    p++;
+                }
+            }
+            ok = hit != negate;
+            next = p < pend ? p + 1 : p;
+        }
+        else if(pat < pend)
+        {
+            if(*pat == '\\' && pat + 1 < pend)
+            {
+                pat++;
+                next = pat + 1;
+            }
+            ok = *pat == *str;
+        }
+
+        if(ok)
+        {
+            pat = next;
+            str++;
+        }
+        else if(star_pat)
+        {
+            pat = star_pat;
+            str = ++star_str;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    while(pat < pend && *pat == '*') pat++;
+    return pat == pend;
+}
+
+// IN : HNode *lhs, HNode *rhs
+// OUT : bool
+// DESC: Compare two Channel nodes by name for equality
+static bool channel_eq(HNode *lhs, HNode *rhs)
+{
+    return container_of(lhs, Channel, node)->name == container_of(rhs, Channel, node)->name;
+}
+
+// IN : const std::string &name, bool create
+// OUT : the Channel, or NULL if it does not exist and create is false
+// DESC: Look up a channel in g_data.channels
+static Channel *channel_get(const std::string &name, bool create)
+{
+    Channel key;
+    key.name = name;
+    key.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+
+    HNode *node = hm_lookup(&g_data.channels, &key.node, &channel_eq);
+    if(node) return container_of(node, Channel, node);
+    if(!create) return NULL;
+
+    Channel *ch = new Channel();
+    ch->name = name;
+    ch->node.hcode = key.node.hcode;
+    hm_insert(&g_data.channels, &ch->node);
+    return ch;
+}
+
+// IN : std::vector<T *> &vec, T *item
+// OUT : returns true if item was found and removed
+// DESC: Unordered removal of a pointer from a vector
+template <class T>
+static bool vec_erase(std::vector<T *> &vec, T *item)
+{
+    for(size_t i = 0 ; i < vec.size() ; ++i)
+    {
+        if(vec[i] == item)
+        {
+            vec[i] = vec.back();
+            vec.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+// IN : Conn *conn, std::vector<SubRef<T>> Conn::*list, T *obj
+// OUT : conn subscribed to obj
+// DESC: Link a connection and a channel or pattern
+template <class T>
+static void sub_add(Conn *conn, std::vector<SubRef<T>> Conn::*list, T *obj)
+{
+    std::vector<SubRef<T>> &mine = conn->*list;
+    SubRef<Conn> theirs;
+    theirs.ptr = conn;
+    theirs.pos = mine.size();
+    obj->subs.push_back(theirs);
+
+    SubRef<T> ref;
+    ref.ptr = obj;
+    ref.pos = obj->subs.size() - 1;
+    mine.push_back(ref);
+}
+
+// IN : Conn *conn, std::vector<SubRef<T>> Conn::*list, size_t i
+// OUT : the subscription (conn->*list)[i] removed from both sides
+// DESC: Swap-and-pop on both vectors, fixing the back index of each moved entry
+template <class T>
+static void sub_remove(Conn *conn, std::vector<SubRef<T>> Conn::*list, size_t i)
+{
+    std::vector<SubRef<T>> &mine = conn->*list;
+    std::vector<SubRef<Conn>> &subs = mine[i].ptr->subs;
+    size_t j = mine[i].pos;
+
+    subs[j] = subs.back();
+    subs.pop_back();
+    if(j < subs.size())
+    {
+        (subs[j].ptr->*list)[subs[j].pos].pos = j;
+    }
+
+    mine[i] = mine.back();
+    mine.pop_back();
+    if(i < mine.size())
+    {
+        mine[i].ptr->subs[mine[i].pos].pos = i;
+    }
+}
+
+// IN : Conn *conn, size_t i
+// OUT : conn no longer subscribed to conn->channels[i]; empty channels are freed
+// DESC: Remove one channel subscription
+static void channel_unsubscribe(Conn *conn, size_t i)
+{
+    Channel *ch = conn->channels[i].ptr;
+    sub_remove(conn, &Conn::channels, i);
+    if(ch->subs.empty())
+    {
+        hm_delete(&g_data.channels, &ch->node, &channel_eq);
+        delete ch;
+    }
+}
+
+// IN : Conn *conn, size_t i
+// OUT : conn no longer subscribed to conn->patterns[i]; empty patterns are freed
+// DESC: Remove one pattern subscription
+static void pattern_unsubscribe(Conn *conn, size_t i)
+{
+    Pattern *pat = conn->patterns[i].ptr;
+    sub_remove(conn, &Conn::patterns, i);
+    if(pat->subs.empty())
+    {
+        vec_erase(g_data.patterns, pat);
+        delete pat;
+    }
+}
+
+// IN : Conn *conn, Response &out
+// OUT : out holds the number of subscriptions of conn
+// DESC: Common reply of the (un)subscribe family
+static void resp_sub_count(Conn *conn, Response &out)
+{
+    resp_str(out, std::to_string(conn->channels.size() + conn->patterns.size()));
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : conn subscribed to every channel in cmd[1..]
+// DESC: Handle "subscribe channel [channel ...]"
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    for(size_t i = 1 ; i < cmd.size() ; ++i)
+    {
+        Channel *ch = channel_get(cmd[i], true);
+        bool found = false;
+        for(SubRef<Channel> &c : conn->channels)
+        {
+            found |= c.ptr == ch;
+        }
+        if(!found)
+        {
+            sub_add(conn, &Conn::channels, ch);
+        }
+    }
+    resp_sub_count(conn, out);
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : conn unsubscribed from the given channels, or from all of them
+// DESC: Handle "unsubscribe [channel ...]"
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    if(cmd.size() == 1)
+    {
+        while(!conn->channels.empty())
+        {
+            channel_unsubscribe(conn, conn->channels.size() - 1);
+        }
+    }
+    for(size_t i = 1 ; i < cmd.size() ; ++i)
+    {
+        Channel *ch = channel_get(cmd[i], false);
+        for(size_t j = 0 ; ch && j < conn->channels.size() ; ++j)
+        {
+            if(conn->channels[j].ptr == ch)
+            {
+                channel_unsubscribe(conn, j);
+                break;
+            }
+        }
+    }
+    resp_sub_count(conn, out);
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : conn subscribed to every pattern in cmd[1..]
+// DESC: Handle "psubscribe pattern [pattern ...]"
+static void do_psubscribe(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    for(size_t i = 1 ; i < cmd.size() ; ++i)
+    {
+        Pattern *pat = NULL;
+        for(Pattern *p : g_data.patterns)
+        {
+            if(p->pattern == cmd[i]) pat = p;
+        }
+        if(!pat)
+        {
+            pat = new Pattern();
+            pat->pattern = cmd[i];
+            g_data.patterns.push_back(pat);
+        }
+
+        bool found = false;
+        for(SubRef<Pattern> &p : conn->patterns)
+        {
+            found |= p.ptr == pat;
+        }
+        if(!found)
+        {
+            sub_add(conn, &Conn::patterns, pat);
+        }
+    }
+    resp_sub_count(conn, out);
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : conn unsubscribed from the given patterns, or from all of them
+// DESC: Handle "punsubscribe [pattern ...]"
+static void do_punsubscribe(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    if(cmd.size() == 1)
+    {
+        while(!conn->patterns.empty())
+        {
+            pattern_unsubscribe(conn, conn->patterns.size() - 1);
+        }
+    }
+    for(size_t i = 1 ; i < cmd.size() ; ++i)
+    {
+        for(size_t j = 0 ; j < conn->patterns.size() ; ++j)
+        {
+            if(conn->patterns[j].ptr->pattern == cmd[i])
+            {
+                pattern_unsubscribe(conn, j);
+                break;
+            }
+        }
+    }
+    resp_sub_count(conn, out);
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : message queued on every subscriber, out holds the receiver count
+// DESC: Handle "publish channel message". The push frame is serialized once
+//       per channel (and once per matching pattern) and queued by reference.
+static void do_publish(std::vector<std::string> &cmd, Response &out)
+{
+    const std::string &name = cmd[1];
+    const std::string &payload = cmd[2];
+    size_t receivers = 0;
+
+    static const std::string k_message = "message";
+    static const std::string k_pmessage = "pmessage";
+
+    if(Channel *ch = channel_get(name, false))
+    {
+        RcBuf *buf = push_new({&k_message, &name, &payload});
+        buf->refs++;    // hold it while fanning out
+        for(SubRef<Conn> &sub : ch->subs)
+        {
+            conn_queue_ref(sub.ptr, buf);
+        }
+        receivers += ch->subs.size();
+        rcbuf_unref(buf);
+    }
+
+    for(Pattern *pat : g_data.patterns)
+    {
+        const std::string &p = pat->pattern;
+        if(!glob_match(p.data(), p.data() + p.size(), name.data(), name.data() + name.size()))
+        {
+            continue;
+        }
+
+        RcBuf *buf = push_new({&k_pmessage, &p, &name, &payload});
+        buf->refs++;
+        for(SubRef<Conn> &sub : pat->subs)
+        {
+            conn_queue_ref(sub.ptr, buf);
+        }
+        receivers += pat->subs.size();
+        rcbuf_unref(buf);
+    }
+
+    resp_str(out, std::to_string(receivers));
+}
+
+// IN : HNode *lhs, HNode *rhs
+// OUT : bool
+// DESC: Compare two TrackedKey nodes by key for equality
+static bool tracked_eq(HNode *lhs, HNode *rhs)
+{
+    return container_of(lhs, TrackedKey, node)->key == container_of(rhs, TrackedKey, node)->key;
+}
+
+// IN : const TrackRef &ref
+// OUT : the connection ref points to if it is still open and tracking reads
+// DESC: Refs are not removed when a connection closes; they are checked here
+static Conn *track_ref_conn(const TrackRef &ref)
+{
+    if((size_t)ref.fd >= g_data.fd2conn.size()) return NULL;
+    Conn *conn = g_data.fd2conn[ref.fd];
+    if(!conn || conn->id != ref.id || conn->tracking != TRACK_DEFAULT) return NULL;
+    return conn;
+}
+
+// IN : HNode *node, void *arg
+// OUT : the TrackedKey owning node is freed
+// DESC: Iterator callback used to empty g_track.keys
+static void tracked_del_cb(HNode *node, void *)
+{
+    delete container_of(node, TrackedKey, node);
+}
+
+// IN : bool bcast
+// OUT : the tracking table is empty; clients told to drop their whole cache
+// DESC: Push ["invalidate"] (no key: flush everything) to every connection
+//       in the default mode, and to broadcast ones too if bcast is set.
+//       Used when the table is full and when the db is replaced.
+static void track_flush_all(bool bcast)
+{
+    HMapIter iter;
+    hm_iter_init(&g_track.keys, &iter);
+    while(hm_iter_next(&iter, (size_t)-1, &tracked_del_cb, NULL)) {}
+    hm_iter_release(&iter);
+    hm_clear(&g_track.keys);
+    g_track.nrefs = 0;
+    g_track.flushes++;
+
+    static const std::string k_invalidate = "invalidate";
+    RcBuf *buf = push_new({&k_invalidate});
+    buf->refs++;
+    for(Conn *conn : g_data.fd2conn)
+    {
+        if(conn && (conn->tracking == TRACK_DEFAULT || (bcast && conn->tracking == TRACK_BCAST)))
+        {
+            conn_queue_ref(conn, buf);
+            g_track.invalidations++;
+        }
+    }
+    rcbuf_unref(buf);
+}
+
+// IN : Conn *conn, const std::string &key
+// OUT : conn will be told when key changes
+// DESC: Remember a read by a connection in the default tracking mode. When
+//       the table holds g_config.tracking_max refs it is flushed first.
+static void track_read(Conn *conn, const std::string &key)
+{
+    TrackedKey probe;
+    probe.key = key;
+    probe.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+
+    TrackedKey *tk = NULL;
+    if(HNode *node = hm_lookup(&g_track.keys, &probe.node, &tracked_eq))
+    {
+        tk = container_of(node, TrackedKey, node);
+        // most repeated reads come from the last reader
+        for(size_t i = tk->refs.size() ; i-- > 0 ;)
+        {
+            if(tk->refs[i].fd == conn->fd && tk->refs[i].id == conn->id) return;
+        }
+    }
+
+    if(g_track.nrefs >= g_config.tracking_max)
+    {
+        track_flush_all(false);
+        tk = NULL;
+    }
+    if(!tk)
+    {
+        tk = new TrackedKey();
+        tk->key = key;
+        tk->node.hcode = probe.node.hcode;
+        hm_insert(&g_track.keys, &tk->node);
+    }
+    tk->refs.push_back(TrackRef {conn->fd, conn->id});
+    g_track.nrefs++;
+}
+
+// IN : const std::string &key
+// OUT : ["invalidate", key] pushed to every connection that may cache key
+// DESC: Called before a write to key. The tracked readers are forgotten
+//       until they read the key again; broadcast connections are matched
+//       by prefix.
+static void track_invalidate(const std::string &key)
+{
+    if(g_track.nrefs == 0 && g_track.bcast.empty()) return;
+
+    static const std::string k_invalidate = "invalidate";
+    RcBuf *buf = NULL;
+
+    TrackedKey probe;
+    probe.key = key;
+    probe.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+    if(HNode *node = hm_delete(&g_track.keys, &probe.node, &tracked_eq))
+    {
+        TrackedKey *tk = container_of(node, TrackedKey, node);
+        for(const TrackRef &ref : tk->refs)
+        {
+            if(Conn *conn = track_ref_conn(ref))
+            {
+                if(!buf)
+                {
+                    buf = push_new({&k_invalidate, &key});
+                    buf->refs++;
+                }
+                conn_queue_ref(conn, buf);
+                g_track.invalidations++;
+            }
+        }
+        g_track.nrefs -= tk->refs.size();
+        delete tk;
+    }
+
+    for(Conn *conn : g_track.bcast)
+    {
+        bool match = conn->prefixes.empty();
+        for(size_t i = 0 ; i < conn->prefixes.size() && !match ; ++i)
+        {
+            const std::string &p = conn->prefixes[i];
+            match = key.size() >= p.size() && memcmp(key.data(), p.data(), p.size()) == 0;
+        }
+        if(!match) continue;
+
+        if(!buf)
+        {
+            buf = push_new({&k_invalidate, &key});
+            buf->refs++;
+        }
+        conn_queue_ref(conn, buf);
+        g_track.invalidations++;
+    }
+
+    if(buf)
+    {
+        rcbuf_unref(buf);
+    }
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : conn's tracking mode updated
+// DESC: Handle "tracking on", "tracking on bcast [prefix ...]" and
+//       "tracking off". Invalidations arrive as RES_PUSH messages.
+static void do_tracking(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    bool on = cmd[1] == "on";
+    bool bcast = cmd.size() >= 3 && cmd[2] == "bcast";
+    if((!on && cmd[1] != "off") || (!on && cmd.size() > 2) || (cmd.size() >= 3 && !bcast)
+        || conn->role != CONN_NORMAL)
+    {
+        out.status = RES_ERR;
+        return resp_str(out, "bad tracking command");
+    }
+
+    if(conn->tracking == TRACK_BCAST)
+    {
+        vec_erase(g_track.bcast, conn);
+    }
+    conn->prefixes.clear();
+    conn->tracking = TRACK_OFF;
+
+    if(on && bcast)
+    {
+        conn->tracking = TRACK_BCAST;
+        conn->prefixes.assign(cmd.begin() + 3, cmd.end());
+        g_track.bcast.push_back(conn);
+    }
+    else if(on)
+    {
+        conn->tracking = TRACK_DEFAULT;
+    }
+}
+
+// IN : const std::string &key
+// OUT : the entry stored under key, or NULL
+// DESC: Plain db lookup
+static Entry *db_find(const std::string &key)
+{
+    Entry probe;
+    probe.key = key;
+    probe.node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+    HNode *node = hm_lookup(&g_data.db, &probe.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+// IN : const std::string &addr
+// OUT : index of addr in g_cluster.nodes, added if new
+// DESC: Intern a "host:port" node address
+static uint16_t cluster_node(const std::string &addr)
+{
+    for(size_t i = 0 ; i < g_cluster.nodes.size() ; ++i)
+    {
+        if(g_cluster.nodes[i] == addr) return (uint16_t)i;
+    }
+    g_cluster.nodes.push_back(addr);
+    return (uint16_t)(g_cluster.nodes.size() - 1);
+}
+
+// IN : const std::string &addr, struct sockaddr_in &out
+// OUT : returns false if addr is not "a.b.c.d:port"
+// DESC: Parse a node address
+static bool parse_addr(const std::string &addr, struct sockaddr_in &out)
+{
+    size_t colon = addr.rfind(':');
+    if(colon == std::string::npos) return false;
+
+    std::string host = addr.substr(0, colon);
+    char *end = NULL;
+    unsigned long port = strtoul(addr.c_str() + colon + 1, &end, 10);
+    if(!end || *end != '\0' || port == 0 || port > 65535) return false;
+
+    out = {};
+    out.sin_family = AF_INET;
+    out.sin_port = htons((uint16_t)port);
+    return inet_pton(AF_INET, host.c_str(), &out.sin_addr) == 1;
+}
+
+// IN : const std::string &s, uint16_t &out
+// OUT : returns false if s is not a slot number
+// DESC: Parse a hash slot
+static bool parse_slot(const std::string &s, uint16_t &out)
+{
+    char *end = NULL;
+    unsigned long v = strtoul(s.c_str(), &end, 10);
+    if(s.empty() || !end || *end != '\0' || v >= k_cluster_slots) return false;
+    out = (uint16_t)v;
+    return true;
+}
+
+// IN : const std::vector<std::string> &cmd
+// OUT : the key cmd must be routed by, or NULL
+// DESC: Commands subject to slot ownership. Other keys of a multi-key
+//       command must hash to the same slot, see do_bitop().
+static const std::string *cmd_key(const std::vector<std::string> &cmd)
+{
+    if(cmd.size() == 2 && (cmd[0] == "get" || cmd[0] == "del")) return &cmd[1];
+    if(cmd.size() == 3 && cmd[0] == "set") return &cmd[1];
+    if(cmd.size() >= 2 && (cmd[0] == "setbit" || cmd[0] == "getbit"
+        || cmd[0] == "bitcount" || cmd[0] == "bitpos"))
+    {
+        return &cmd[1];
+    }
+    if(cmd.size() >= 4 && cmd[0] == "bitop") return &cmd[2];
+    return NULL;
+}
+
+// IN : Response &out, uint32_t status, uint16_t slot, uint16_t node
+// OUT : out holds a MOVED or ASK redirect
+// DESC: Point the client at the node serving slot
+static void cluster_redirect(Response &out, uint32_t status, uint16_t slot, uint16_t node)
+{
+    out.status = status;
+    resp_str(out, std::to_string(slot) + " " + g_cluster.nodes[node]);
+}
+
+// IN : uint16_t slot, const std::string &key
+// OUT : returns true if the target has not acknowledged the last state of key
+// DESC: Such a key is served here rather than sent to the target with ASK
+static bool migrate_pending(uint16_t slot, const std::string &key)
+{
+    if(slot != g_migrate.slot) return false;
+    return g_migrate.inflight.count(key) || g_migrate.dirty.count(key);
+}
+
+// IN : const std::string &key, bool asking, Response &out
+// OUT : returns true if the key is served here, otherwise out holds a redirect
+// DESC: Slot ownership check. A slot being migrated away is still served for
+//       keys that are here; missing keys are already (or will be) on the
+//       target, so the client is sent there with ASK. A key deleted here
+//       whose final state the target has not acknowledged yet is still
+//       served here, the target may hold an old copy of it. A slot being
+//       imported is only served to clients that sent "asking".
+static bool cluster_route(const std::string &key, bool asking, Response &out)
+{
+    uint16_t slot = key_slot((const uint8_t *)key.data(), key.size());
+    uint16_t owner = g_cluster.owner[slot];
+    if(owner == 0)
+    {
+        uint16_t to = g_cluster.migrating[slot];
+        if(to != k_no_node && !db_find(key) && !migrate_pending(slot, key))
+        {
+            cluster_redirect(out, RES_ASK, slot, to);
+            return false;
+        }
+        return true;
+    }
+    if(asking && g_cluster.importing[slot] != k_no_node)
+    {
+        return true;
+    }
+    if(owner == k_no_node)
+    {
+        out.status = RES_ERR;
+        resp_str(out, "CLUSTERDOWN slot " + std::to_string(slot) + " not served");
+        return false;
+    }
+    cluster_redirect(out, RES_MOVED, slot, owner);
+    return false;
+}
+
+// IN : const std::string &key
+// OUT : key marked dirty if a copy of it is in flight to the importing node
+// DESC: Called before a local write to a key of the slot being migrated.
+//       After an abort every write to the slot is marked, so resuming sends
+//       the target a "del" for moved keys deleted here in the meantime.
+static void migrate_touch(const std::string &key)
+{
+    if(g_migrate.aborted)
+    {
+        if(key_slot((const uint8_t *)key.data(), key.size()) == g_migrate.slot)
+        {
+            g_migrate.dirty.insert(key);
+        }
+        return;
+    }
+    if(g_migrate.inflight.empty()) return;
+    if(g_migrate.inflight.count(key))
+    {
+        g_migrate.dirty.insert(key);
+    }
+}
+
+// IN : const std::string &key
+// OUT : the current state of key queued on the migration link
+// DESC: Send "asking" + "set key val", or "del key" if it is gone here
+static void migrate_send_key(const std::string &key)
+{
+    std::vector<uint8_t> &out = g_migrate.link->outgoing;
+    buf_append_cmd(out, {"asking"});
+    g_migrate.ops.push_back(MigrateOp {MIG_ASKING, std::string()});
+
+    Entry *ent = db_find(key);
+    if(!ent)
+    {
+        buf_append_cmd(out, {"del", key});
+        g_migrate.ops.push_back(MigrateOp {MIG_DEL, key});
+    }
+    else
+    {
+        uint32_t size = (uint32_t)entry_raw_size(ent);
+        buf_append_u32(out, 4 + 4 + 3 + 4 + (uint32_t)key.size() + 4 + size);
+        buf_append_u32(out, 3);
+        buf_append_str(out, "set");
+        buf_append_str(out, key);
+        buf_append_u32(out, size);
+        size_t pos = out.size();
+        out.resize(pos + size);
+        entry_read(ent, &out[pos]);
+        g_migrate.ops.push_back(MigrateOp {MIG_SET, key});
+    }
+    g_migrate.inflight[key]++;
+}
+
+// IN : Conn *conn, const uint8_t *data, size_t len
+// OUT : returns false if the importing node refused a message
+// DESC: Handle one reply on the migration link. An acknowledged key is
+//       deleted here unless it was written again since it was sent.
+static bool migrate_reply(Conn *conn, const uint8_t *data, size_t len)
+{
+    if(len < 4 || g_migrate.ops.empty()) return false;
+
+    uint32_t status = RES_ERR;
+    memcpy(&status, data, 4);
+    MigrateOp op = g_migrate.ops.front();
+    g_migrate.ops.pop_front();
+    if(status != RES_OK)
+    {
+        fprintf(stderr, "Migration of slot %u refused: [%u] %.*s\n", g_migrate.slot,
+                status, (int)(len - 4), (const char *)data + 4);
+        return false;
+    }
+
+    if(op.kind == MIG_SETUP)
+    {
+        g_migrate.linked = true;
+    }
+    else if(op.kind == MIG_SET || op.kind == MIG_DEL)
+    {
+        std::map<std::string, uint32_t>::iterator it = g_migrate.inflight.find(op.key);
+        assert(it != g_migrate.inflight.end());
+        if(--it->second > 0) return true;
+        g_migrate.inflight.erase(it);
+        if(g_migrate.dirty.count(op.key)) return true;     // sent again later
+
+        if(op.kind == MIG_SET)
+        {
+            track_invalidate(op.key);
+            bitop_touch(op.key);
+            std::vector<std::string> del = {"del", op.key};
+            Response unused;
+            do_del(del, unused);
+            g_migrate.moved++;
+        }
+    }
+    else if(op.kind == MIG_FINISH)
+    {
+        uint16_t slot = g_migrate.slot;
+        g_cluster.owner[slot] = g_migrate.target;
+        g_cluster.migrating[slot] = k_no_node;
+        fprintf(stderr, "Slot %u migrated to %s, %llu keys\n", slot,
+                g_cluster.nodes[g_migrate.target].c_str(), (unsigned long long)g_migrate.moved);
+        g_migrate.active = false;
+        conn->want_close = true;
+    }
+    return true;
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : out holds the result of the cluster subcommand
+// DESC: Handle "cluster <subcommand> ...":
+//         keyslot KEY
+//         slots                       "start end host:port" per line
+//         info
+//         countkeysinslot SLOT
+//         setslot SLOT node|importing|migrating HOST:PORT
+//         setslot SLOT importing HOST:PORT link
+//                                     importing until this connection closes
+//         setslot SLOT stable         clear importing/migrating
+//         migrate SLOT HOST:PORT      start a live migration of an owned slot
+static void do_cluster(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    out.status = RES_ERR;
+    if(!g_cluster.enabled)
+    {
+        return resp_str(out, "cluster mode disabled");
+    }
+
+    const std::string &sub = cmd[1];
+    uint16_t slot = 0;
+    if(sub == "keyslot" && cmd.size() == 3)
+    {
+        out.status = RES_OK;
+        return resp_str(out, std::to_string(key_slot((const uint8_t *)cmd[2].data(), cmd[2].size())));
+    }
+    if(sub == "slots" && cmd.size() == 2)
+    {
+        std::string text;
+        for(uint32_t lo = 0 ; lo < k_cluster_slots ;)
+        {
+            uint32_t hi = lo;
+            uint16_t owner = g_cluster.owner[lo];
+            while(hi + 1 < k_cluster_slots && g_cluster.owner[hi + 1] == owner) hi++;
+            if(owner != k_no_node)
+            {
+                text += std::to_string(lo) + " " + std::to_string(hi) + " "
+                      + g_cluster.nodes[owner] + "\n";
+            }
+            lo = hi + 1;
+        }
+        out.status = RES_OK;
+        return resp_str(out, text);
+    }
+    if(sub == "info" && cmd.size() == 2)
+    {
+        size_t owned = 0, importing = 0;
+        for(uint32_t i = 0 ; i < k_cluster_slots ; ++i)
+        {
+            owned += g_cluster.owner[i] == 0;
+            importing += g_cluster.importing[i] != k_no_node;
+        }
+        char buf[512];
+        snprintf(buf, sizeof(buf),
+            "myself:%s\n"
+            "nodes:%zu\n"
+            "slots_owned:%zu\n"
+            "slots_importing:%zu\n"
+            "migrating_slot:%d\n"
+            "migrating_to:%s\n"
+            "migrate_keys_moved:%llu\n"
+            "migrate_keys_inflight:%zu\n",
+            g_cluster.nodes[0].c_str(),
+            g_cluster.nodes.size(),
+            owned,
+            importing,
+            g_migrate.active ? (int)g_migrate.slot : -1,
+            g_migrate.active ? g_cluster.nodes[g_migrate.target].c_str() : "-",
+            (unsigned long long)g_migrate.moved,
+            g_migrate.inflight.size());
+        out.status = RES_OK;
+        return resp_str(out, buf);
+    }
+    if(sub == "countkeysinslot" && cmd.size() == 3)
+    {
+        if(!parse_slot(cmd[2], slot)) return resp_str(out, "bad slot");
+        out.status = RES_OK;
+        return resp_str(out, std::to_string(g_cluster.keys[slot]));
+    }
+    if(sub == "setslot" && cmd.size() == 4 && cmd[3] == "stable")
+    {
+        if(!parse_slot(cmd[2], slot)) return resp_str(out, "bad slot");
+        if(g_migrate.active && g_migrate.slot == slot) return resp_str(out, "slot is migrating");
+        g_cluster.importing[slot] = k_no_node;
+        g_cluster.migrating[slot] = k_no_node;
+        if(g_migrate.slot == slot)
+        {
+            g_migrate.dirty.clear();
+            g_migrate.aborted = false;
+        }
+        out.status = RES_OK;
+        return;
+    }
+    bool link = cmd.size() == 6 && cmd[3] == "importing" && cmd[5] == "link";
+    if(sub == "setslot" && (cmd.size() == 5 || link))
+    {
+        struct sockaddr_in addr;
+        if(!parse_slot(cmd[2], slot)) return resp_str(out, "bad slot");
+        if(!parse_addr(cmd[4], addr)) return resp_str(out, "bad address");
+        if(g_migrate.active && g_migrate.slot == slot) return resp_str(out, "slot is migrating");
+
+        uint16_t node = cluster_node(cmd[4]);
+        if(cmd[3] == "node")
+        {
+            g_cluster.owner[slot] = node;
+            g_cluster.importing[slot] = k_no_node;
+            g_cluster.migrating[slot] = k_no_node;
+        }
+        else if(cmd[3] == "importing" && node != 0)
+        {
+            if(g_cluster.owner[slot] == 0) return resp_str(out, "slot is already served here");
+            g_cluster.importing[slot] = node;
+            if(link) conn->import_slot = slot;
+        }
+        else if(cmd[3] == "migrating" && node != 0)
+        {
+            if(g_cluster.owner[slot] != 0) return resp_str(out, "slot is not served here");
+            g_cluster.migrating[slot] = node;
+        }
+        else
+        {
+            return resp_str(out, "bad setslot");
+        }
+        out.status = RES_OK;
+        return;
+    }
+    if(sub == "migrate" && cmd.size() == 4)
+    {
+        struct sockaddr_in addr;
+        if(!parse_slot(cmd[2], slot)) return resp_str(out, "bad slot");
+        if(!parse_addr(cmd[3], addr)) return resp_str(out, "bad address");
+        if(g_repl.is_replica) return resp_str(out, "READONLY replica");
+        if(g_migrate.active || g_migrate.link) return resp_str(out, "a migration is already running");
+        if(g_cluster.owner[slot] != 0) return resp_str(out, "slot is not served here");
+
+        uint16_t node = cluster_node(cmd[3]);
+        if(node == 0) return resp_str(out, "cannot migrate to myself");
+
+        // the link is opened by the event loop, see migrate_update(); keys
+        // left dirty by an aborted migration of this slot are sent first
+        if(g_migrate.slot != slot || g_migrate.target != node) g_migrate.dirty.clear();
+        g_cluster.migrating[slot] = node;
+        g_migrate.active = true;
+        g_migrate.linked = false;
+        g_migrate.aborted = false;
+        g_migrate.slot = slot;
+        g_migrate.target = node;
+        g_migrate.addr = addr;
+        g_migrate.moved = 0;
+        out.status = RES_OK;
+        return resp_str(out, "migrating " + std::to_string(g_cluster.keys[slot]) + " keys");
+    }
+    resp_str(out, "bad cluster command");
+}
+
+// IN : const std::string &s, int64_t &out
+// OUT : returns false if s is not a decimal integer
+// DESC: Parse a signed command argument
+static bool parse_int(const std::string &s, int64_t &out)
+{
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(s.c_str(), &end, 10);
+    if(s.empty() || !end || *end != '\0' || errno) return false;
+    out = v;
+    return true;
+}
+
+// IN : Entry *ent, std::string &tmp
+// OUT : the uncompressed value, in place or decompressed into tmp
+// DESC: Read access to a value for the bitmap commands
+static const uint8_t *entry_bytes(Entry *ent, std::string &tmp)
+{
+    if(ent->enc == ENC_RAW)
+    {
+        return (const uint8_t *)ent->val.data();
+    }
+    tmp.resize(ent->raw_len);
+    entry_read(ent, (uint8_t *)&tmp[0]);
+    return (const uint8_t *)tmp.data();
+}
+
+// IN : Entry *ent
+// OUT : ent->val holds the raw value
+// DESC: Decompress a value that is about to be modified in place. It stays
+//       raw: bitmaps are small random writes, not worth recompressing.
+static void entry_make_raw(Entry *ent)
+{
+    if(ent->enc == ENC_RAW) return;
+
+    std::string raw;
+    entry_bytes(ent, raw);
+    entry_stats_remove(ent);
+    ent->val.swap(raw);
+    ent->enc = ENC_RAW;
+    ent->raw_len = 0;
+}
+
+// IN : int64_t start, int64_t end, size_t len, size_t &lo, size_t &hi
+// OUT : returns false if the range is empty, else [lo, hi) within len
+// DESC: Resolve an inclusive byte range; negative indexes count from the end
+static bool byte_range(int64_t start, int64_t end, size_t len, size_t &lo, size_t &hi)
+{
+    int64_t n = (int64_t)len;
+    if(start < 0) start += n;
+    if(end < 0) end += n;
+    if(start < 0) start = 0;
+    if(end >= n) end = n - 1;
+    if(start > end) return false;
+    lo = (size_t)start;
+    hi = (size_t)end + 1;
+    return true;
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : out holds the previous bit
+// DESC: Handle "setbit key offset 0|1"; the value grows with zero bytes
+static void do_setbit(std::vector<std::string> &cmd, Response &out)
+{
+    int64_t offset = 0;
+    if(!parse_int(cmd[2], offset) || offset < 0 || (uint64_t)offset >= k_max_bitmap * 8)
+    {
+        out.status = RES_ERR;
+        return resp_str(out, "bit offset is not an integer or out of range");
+    }
+    if(cmd[3] != "0" && cmd[3] != "1")
+    {
+        out.status = RES_ERR;
+        return resp_str(out, "bit is not 0 or 1");
+    }
+    repl_feed(cmd);
+
+    Entry *ent = db_find(cmd[1]);
+    if(!ent)
+    {
+        std::string empty;
+        ent = db_put(cmd[1], empty);
+    }
+    entry_make_raw(ent);
+
+    size_t byte = (size_t)offset >> 3;
+    uint8_t mask = (uint8_t)(0x80 >> (offset & 7));
+    if(ent->val.size() <= byte)
+    {
+        ent->val.resize(byte + 1, '\0');
+    }
+    uint8_t &b = (uint8_t &)ent->val[byte];
+    bool old = (b & mask) != 0;
+    if(cmd[3] == "1") b |= mask;
+    else b &= (uint8_t)~mask;
+    resp_str(out, old ? "1" : "0");
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : out holds the bit, 0 past the end of the value
+// DESC: Handle "getbit key offset"
+static void do_getbit(std::vector<std::string> &cmd, Response &out)
+{
+    int64_t offset = 0;
+    if(!parse_int(cmd[2], offset) || offset < 0)
+    {
+        out.status = RES_ERR;
+        return resp_str(out, "bit offset is not an integer or out of range");
+    }
+
+    Entry *ent = db_find(cmd[1]);
+    size_t byte = (uint64_t)offset >> 3;
+    if(!ent || byte >= entry_raw_size(ent))
+    {
+        return resp_str(out, "0");
+    }
+    std::string tmp;
+    const uint8_t *p = entry_bytes(ent, tmp);
+    resp_str(out, (p[byte] & (0x80 >> (offset & 7))) ? "1" : "0");
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : out holds the number of set bits
+// DESC: Handle "bitcount key [start end]", a byte range
+static void do_bitcount(std::vector<std::string> &cmd, Response &out)
+{
+    int64_t start = 0;
+    int64_t end = -1;
+    if(cmd.size() == 4 && (!parse_int(cmd[2], start) || !parse_int(cmd[3], end)))
+    {
+        out.status = RES_ERR;
+        return resp_str(out, "value is not an integer");
+    }
+
+    Entry *ent = db_find(cmd[1]);
+    size_t lo = 0;
+    size_t hi = 0;
+    if(!ent || !byte_range(start, end, entry_raw_size(ent), lo, hi))
+    {
+        return resp_str(out, "0");
+    }
+    std::string tmp;
+    const uint8_t *p = entry_bytes(ent, tmp);
+    resp_str(out, std::to_string(bit_count(p + lo, hi - lo)));
+}
+
+// IN : std::vector<std::string> &cmd, Response &out
+// OUT : out holds the bit index, or -1
+// DESC: Handle "bitpos key 0|1 [start [end]]". Without an end, a value of
+//       all ones has its first clear bit just past the end.
+static void do_bitpos(std::vector<std::string> &cmd, Response &out)
+{
+    int64_t start = 0;
+    int64_t end = -1;
+    if((cmd[2] != "0" && cmd[2] != "1")
+        || (cmd.size() >= 4 && !parse_int(cmd[3], start))
+        || (cmd.size() == 5 && !parse_int(cmd[4], end)))
+    {
+        out.status = RES_ERR;
+        return resp_str(out, "bit must be 0 or 1, range must be integers");
+    }
+    int bit = cmd[2] == "1";
+
+    Entry *ent = db_find(cmd[1]);
+    if(!ent)
+    {
+        return resp_str(out, bit ? "-1" : "0");
+    }
+    size_t len = entry_raw_size(ent);
+    size_t lo = 0;
+    size_t hi = 0;
+    if(!byte_range(start, end, len, lo, hi))
+    {
+        return resp_str(out, "-1");
+    }
+
+    std::string tmp;
+    const uint8_t *p = entry_bytes(ent, tmp);
+    int64_t pos = bit_find(p + lo, hi - lo, bit);
+    if(pos >= 0)
+    {
+        pos += (int64_t)lo * 8;
+    }
+    else if(!bit && cmd.size() < 5)
+    {
+        pos = (int64_t)hi * 8;
+    }
+    resp_str(out, std::to_string(pos));
+}
+
+// IN : BitopJob *job
+// OUT : sources resolved, the result reset
+// DESC: (Re)start a bitop. LZ4 sources are decompressed here, in one go.
+static void bitop_load(BitopJob *job)
+{
+    size_t nsrc = job->cmd.size() - 3;
+    job->src.assign(nsrc, NULL);
+    job->src_len.assign(nsrc, 0);
+    job->plain.resize(nsrc);
+    job->len = 0;
+    for(size_t i = 0 ; i < nsrc ; ++i)
+    {
+        Entry *ent = db_find(job->cmd[3 + i]);
+        if(!ent) continue;
+        job->src[i] = entry_bytes(ent, job->plain[i]);
+        job->src_len[i] = entry_raw_size(ent);
+        if(job->src_len[i] > job->len) job->len = job->src_len[i];
+    }
+    // capacity only: pages are touched as the result is computed
+    job->result.clear();
+    job->result.reserve(job->len);
+    job->restart = false;
+}
+
+// IN : BitopJob *job, size_t n
+// OUT : up to n more bytes of the result computed
+// DESC: One step of a bitop. Missing bytes of shorter sources are zeros.
+static void bitop_run(BitopJob *job, size_t n)
+{
+    size_t pos = job->result.size();
+    if(n > job->len - pos) n = job->len - pos;
+    job->result.append(n, '\0');
+    uint8_t *dst = (uint8_t *)&job->result[pos];
+
+    for(size_t i = 0 ; i < job->src.size() ; ++i)
+    {
+        size_t avail = job->src_len[i] > pos ? job->src_len[i] - pos : 0;
+        if(avail > n) avail = n;
+        const uint8_t *src = job->src[i] + (avail ? pos : 0);
+        if(i == 0)
+        {
+            if(avail) memcpy(dst, src, avail);  // the rest is already zero
+            if(job->op == BIT_NOT) bit_op(BIT_NOT, dst, dst, n);
+            continue;
+        }
+        bit_op(job->op, dst, src, avail);
+        if(job->op == BIT_AND)
+        {
+            memset(dst + avail, 0, n - avail);
+        }
+    }
+}
+
+// IN : const std::string &key, Response &out
+// OUT : returns false and fills out if the key's slot is being migrated
+// DESC: Multi-key commands are refused while their keys may be split
+//       between two nodes
+static bool cluster_slot_stable(const std::string &key, Response &out)
+{
+    uint16_t slot = key_slot((const uint8_t *)key.data(), key.size());
+    if(g_cluster.owner[slot] == 0 && g_cluster.migrating[slot] == k_no_node
+        && g_cluster.importing[slot] == k_no_node)
+    {
+        return true;
+    }
+    out.status = RES_ERR;
+    resp_str(out, "TRYAGAIN slot " + std::to_string(slot) + " is being migrated");
+    return false;
+}
+
+// IN : BitopJob *job, Response &out
+// OUT : the result stored in the destination key, out holds its length
+// DESC: Complete a bitop. Replicas get the result as "set" (or "del" when
+//       it is empty), not the command: a replica loading a snapshot may
+//       hold newer source values than the ones the result was computed from.
+static void bitop_store(BitopJob *job, Response &out)
+{
+    std::string &dest = job->cmd[2];
+    if(g_cluster.enabled && !cluster_slot_stable(dest, out))
+    {
+        return;
+    }
+
+    migrate_touch(dest);
+    track_invalidate(dest);
+    size_t len = job->result.size();
+    if(len == 0)
+    {
+        repl_feed({"del", dest});
+        db_remove(dest);
+    }
+    else
+    {
+        // lend the result to the stream command instead of copying it
+        std::vector<std::string> set = {"set", dest, std::string()};
+        set[2].swap(job->result);
+        repl_feed(set);
+        set[2].swap(job->result);
+        std::string key = dest;
+        db_put(key, job->result);
+    }
+    bitop_touch(dest);
+    resp_str(out, std::to_string(len));
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : out holds the result length, or the reply is deferred
+// DESC: Handle "bitop and|or|xor|not dest src [src ...]". Results longer
+//       than k_bitop_step are computed by bitop_update() across loop
+//       iterations; conn is blocked until then. The stream from a primary
+//       is applied at once, it must stay in order.
+static void do_bitop(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    int op = -1;
+    if(cmd[1] == "and") op = BIT_AND;
+    else if(cmd[1] == "or") op = BIT_OR;
+    else if(cmd[1] == "xor") op = BIT_XOR;
+    else if(cmd[1] == "not" && cmd.size() == 4) op = BIT_NOT;
+    if(op < 0)
+    {
+        out.status = RES_ERR;
+        return resp_str(out, "bitop and|or|xor dest src [src ...], or bitop not dest src");
+    }
+    if(g_cluster.enabled && conn->role == CONN_NORMAL)
+    {
+        uint16_t slot = key_slot((const uint8_t *)cmd[2].data(), cmd[2].size());
+        for(size_t i = 3 ; i < cmd.size() ; ++i)
+        {
+            if(key_slot((const uint8_t *)cmd[i].data(), cmd[i].size()) != slot)
+            {
+                out.status = RES_ERR;
+                return resp_str(out, "CROSSSLOT keys don't hash to the same slot");
+            }
+        }
+        if(!cluster_slot_stable(cmd[2], out)) return;
+    }
+
+    BitopJob *job = new BitopJob();
+    job->cmd.swap(cmd);
+    job->op = op;
+    bitop_load(job);
+    if(job->len <= k_bitop_step || conn->role == CONN_MASTER)
+    {
+        bitop_run(job, job->len);
+        bitop_store(job, out);
+        delete job;
+        return;
+    }
+
+    job->conn = conn;
+    conn->bitop = job;
+    g_bitop.jobs.push_back(job);
+}
+
+// IN : int fd
+// OUT : Conn * for the new client, or NULL on failure
+// DESC: Accept a new connection on the listening socket and initialize a Conn struct
+static Conn *handle_accept(int fd)
+{
+    struct sockaddr_storage ss = {};
+    socklen_t addrlen = sizeof(ss);
+    int connfd = accept(fd, (struct sockaddr *)&ss, &addrlen);
+    if(connfd < 0)
+    {
+        msg_errno("accept() error");
+        return NULL;
+    }
+
+    if(ss.ss_family == AF_INET)
+    {
+        struct sockaddr_in *client_addr = (struct sockaddr_in *)&ss;
+        uint32_t ip = client_addr->sin_addr.s_addr;
+        fprintf(stderr, "New Client from %u.%u.%u.%u.%u\n",
+                ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
+                ntohs(client_addr->sin_port));
+    }
+    else
+    {
+        msg("New Client on unix socket");
+    }
+
+    fd_set_nb(connfd);
+    fd_set_sockopts(connfd, ss.ss_family == AF_INET);
+
+    Conn *conn = new Conn();
+    conn->fd = connfd;
+    conn->id = g_track.next_id++;
+    conn->want_read = true;
+    return conn;
+}
+
+// IN : const uint8_t *&cur, const uint8_t *end, uint32_t &out
+// OUT : bool indicating success, out updated
+// DESC: Read a 32-bit unsigned integer from the buffer and advance the pointer
+static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out)
+{
+    if(cur + 4 > end) return false;
+    memcpy(&out, cur, 4);
+    cur += 4;
+    return true;
+}
+
+// IN : const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out
+// OUT : bool indicating success, out updated
+// DESC: Read n bytes from buffer into a string and advance the pointer
+static bool read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out)
+{
+    if(cur + n > end) return false;
+    out.assign(cur, cur + n);
+    cur += n;
+    return true;
+}
+
+// IN : const uint8_t *data, size_t size, std::vector<std::string> &out
+// OUT : returns 0 on success, -1 on failure; out populated with parsed strings
+// DESC: Parse a request message into individual string arguments
+static int32_t parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out)
+{
+    const uint8_t *end = data + size;
+    uint32_t nstr = 0;
+
+    if(!read_u32(data, end, nstr)) return -1;
+    if(nstr > k_max_args) return -1;
+
+    while(out.size() < nstr)
+    {
+        uint32_t len = 0;
+        if(!read_u32(data, end, len)) return -1;
+
+        out.push_back(std::string());
+        if(!read_str(data, end, len, out.back())) return -1;
+    }
+
+    if(data != end) return -1;
+    return 0;
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, Response &out
+// OUT : Response updated according to command
+// DESC: Dispatch a parsed request to the appropriate handler
+static void do_request(Conn *conn, std::vector<std::string> &cmd, Response &out)
+{
+    bool asking = conn->asking;
+    conn->asking = false;
+    if(g_cluster.enabled && conn->role == CONN_NORMAL)
+    {
+        const std::string *key = cmd_key(cmd);
+        if(key && !cluster_route(*key, asking, out)) return;
+    }
+
+    if(cmd.size() == 2 && cmd[0] == "get")
+    {
+        if(conn->tracking == TRACK_DEFAULT) track_read(conn, cmd[1]);
+        return do_get(cmd, out);
+    }
+    else if(cmd.size() == 3 && cmd[0] == "set")
+    {
+        if(!check_writable(conn, out)) return;
+        migrate_touch(cmd[1]);
+        track_invalidate(cmd[1]);
+        bitop_touch(cmd[1]);
+        return do_set(cmd, out);
+    }
+    else if(cmd.size() == 2 && cmd[0] == "del")
+    {
+        if(!check_writable(conn, out)) return;
+        migrate_touch(cmd[1]);
+        track_invalidate(cmd[1]);
+        bitop_touch(cmd[1]);
+        return do_del(cmd, out);
+    }
+    else if(cmd.size() == 4 && cmd[0] == "setbit")
+    {
+        if(!check_writable(conn, out)) return;
+        migrate_touch(cmd[1]);
+        track_invalidate(cmd[1]);
+        bitop_touch(cmd[1]);
+        return do_setbit(cmd, out);
+    }
+    else if(cmd.size() == 3 && cmd[0] == "getbit")
+    {
+        if(conn->tracking == TRACK_DEFAULT) track_read(conn, cmd[1]);
+        return do_getbit(cmd, out);
+    }
+    else if((cmd.size() == 2 || cmd.size() == 4) && cmd[0] == "bitcount")
+    {
+        if(conn->tracking == TRACK_DEFAULT) track_read(conn, cmd[1]);
+        return do_bitcount(cmd, out);
+    }
+    else if(cmd.size() >= 3 && cmd.size() <= 5 && cmd[0] == "bitpos")
+    {
+        if(conn->tracking == TRACK_DEFAULT) track_read(conn, cmd[1]);
+        return do_bitpos(cmd, out);
+    }
+    else if(cmd.size() >= 4 && cmd[0] == "bitop")
+    {
+        if(!check_writable(conn, out)) return;
+        return do_bitop(conn, cmd, out);
+    }
+    else if(cmd.size() == 1 && cmd[0] == "ping")
+    {
+        return resp_str(out, "PONG");
+    }
+    else if(cmd.size() == 1 && cmd[0] == "stats")
+    {
+        return do_stats(out);
+    }
+    else if(cmd.size() == 3 && cmd[0] == "sync")
+    {
+        return do_sync(conn, cmd, out);
+    }
+    else if(cmd.size() >= 2 && cmd[0] == "subscribe")
+    {
+        return do_subscribe(conn, cmd, out);
+    }
+    else if(cmd.size() >= 1 && cmd[0] == "unsubscribe")
+    {
+        return do_unsubscribe(conn, cmd, out);
+    }
+    else if(cmd.size() >= 2 && cmd[0] == "psubscribe")
+    {
+        return do_psubscribe(conn, cmd, out);
+    }
+    else if(cmd.size() >= 1 && cmd[0] == "punsubscribe")
+    {
+        return do_punsubscribe(conn, cmd, out);
+    }
+    else if(cmd.size() == 3 && cmd[0] == "publish")
+    {
+        return do_publish(cmd, out);
+    }
+    else if(cmd.size() >= 2 && cmd[0] == "tracking")
+    {
+        return do_tracking(conn, cmd, out);
+    }
+    else if(cmd.size() == 1 && cmd[0] == "asking")
+    {
+        conn->asking = true;
+        return;
+    }
+    else if(cmd.size() >= 2 && cmd[0] == "cluster")
+    {
+        return do_cluster(conn, cmd, out);
+    }
+    else
+    {
+        out.status = RES_ERR;
+    }
+}
+
+// IN : const Response &resp, Conn *conn
+// OUT : conn outgoing stream contains serialized response
+// DESC: Convert Response struct into bytes to send to client
+static void make_response(const Response &resp, Conn *conn)
+{
+    std::vector<uint8_t> &out = conn->outgoing;
+    uint32_t resp_len = 4 + (uint32_t)resp.data.size();
+    if(resp.ref)
+    {
+        resp_len += (uint32_t)resp.ref->data.size();
+    }
+    buf_append(out, (const uint8_t *)&resp_len, 4);
+    buf_append(out, (const uint8_t *)&resp.status, 4);
+    buf_append(out, resp.data.data(), resp.data.size());
+    if(resp.ref)
+    {
+        conn_queue_ref(conn, resp.ref);
+    }
+}
+
+// IN : Conn *conn, const uint8_t *data, size_t len
+// OUT : returns false if the primary refused the sync
+// DESC: Handle the primary's reply to our sync request
+static bool repl_handshake(Conn *conn, const uint8_t *data, size_t len)
+{
+    uint32_t status = RES_ERR;
+    if(len < 4) return false;
+    memcpy(&status, data, 4);
+    std::string reply((const char *)data + 4, len - 4);
+    if(status != RES_OK)
+    {
+        fprintf(stderr, "Primary refused sync: %s\n", reply.c_str());
+        return false;
+    }
+
+    if(reply == "CONTINUE")
+    {
+        msg("Partial resync with primary.");
+        conn->repl_state = REPL_ONLINE;
+        return true;
+    }
+
+    char replid[41] = {};
+    unsigned long long offset = 0;
+    unsigned long long nkeys = 0;
+    if(sscanf(reply.c_str(), "FULLRESYNC %40s %llu %llu", replid, &offset, &nkeys) < 2)
+    {
+        return false;
+    }
+
+    // The replid is adopted at "syncdone": a link lost while the snapshot
+    // loads must lead to another full resync, not continue on partial data.
+    msg("Full resync with primary.");
+    strcpy(g_repl.master_replid, "?");
+    memcpy(g_repl.sync_replid, replid, sizeof(replid));
+    g_repl.master_offset = offset;
+    db_clear();
+    track_flush_all(true);
+    hm_reserve(&g_data.db, (size_t)nkeys);
+    conn->repl_state = REPL_SNAPSHOT;
+    return true;
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, uint32_t len
+// OUT : cmd applied to the db; the reply is discarded
+// DESC: Apply one message of the snapshot or stream received from the primary
+static void repl_apply(Conn *conn, std::vector<std::string> &cmd, uint32_t len)
+{
+    if(conn->repl_state == REPL_SNAPSHOT && cmd.size() == 1 && cmd[0] == "syncdone")
+    {
+        msg("Initial sync done.");
+        memcpy(g_repl.master_replid, g_repl.sync_replid, sizeof(g_repl.sync_replid));
+        conn->repl_state = REPL_ONLINE;
+        return;
+    }
+
+    Response resp;
+    do_request(conn, cmd, resp);
+    if(resp.ref)
+    {
+        delete resp.ref;
+    }
+
+    if(conn->repl_state == REPL_ONLINE)
+    {
+        g_repl.master_offset += 4 + len;
+    }
+}
+
+// IN : Conn *conn, uint32_t &out
+// OUT : returns false if fewer than 4 bytes are buffered
+// DESC: Consume a 32-bit integer from the front of conn->incoming
+static bool stream_u32(Conn *conn, uint32_t &out)
+{
+    ReqStream &st = conn->stream;
+    if(conn->incoming.size() < 4) return false;
+
+    memcpy(&out, conn->incoming.data(), 4);
+    buf_remove(conn->incoming, 4);
+    st.body_left -= 4;
+    return true;
+}
+
+// IN : ReqStream &st
+// OUT : cmd.back(), with room past arg_filled unless it is complete
+// DESC: Grow the argument being filled by at least k_stream_threshold,
+//       doubling, and never past its declared length. Allocation stays
+//       within about twice the bytes actually received.
+static std::string &stream_grow(ReqStream &st)
+{
+    std::string &arg = st.cmd.back();
+    if(st.arg_filled < arg.size() || arg.size() == st.arg_len) return arg;
+
+    size_t want = arg.size() * 2;
+    if(want < arg.size() + k_stream_threshold) want = arg.size() + k_stream_threshold;
+    if(want > st.arg_len) want = st.arg_len;
+    arg.resize(want);
+    return arg;
+}
+
+// IN : Conn *conn
+// OUT : 1 when the request is complete, 0 if more bytes are needed, -1 on error
+// DESC: Move buffered bytes into the streamed request's arguments
+static int32_t stream_feed(Conn *conn)
+{
+    ReqStream &st = conn->stream;
+    while(true)
+    {
+        if(!st.have_nstr)
+        {
+            if(st.body_left < 4) return -1;
+            if(!stream_u32(conn, st.nstr)) return 0;
+            if(st.nstr > k_max_args) return -1;
+            st.have_nstr = true;
+        }
+        else if(st.in_arg)
+        {
+            std::string &arg = stream_grow(st);
+            size_t n = arg.size() - st.arg_filled;
+            if(n > conn->incoming.size()) n = conn->incoming.size();
+            memcpy(&arg[st.arg_filled], conn->incoming.data(), n);
+            buf_remove(conn->incoming, n);
+            st.arg_filled += n;
+            st.body_left -= (uint32_t)n;
+            if(st.arg_filled < st.arg_len)
+            {
+                if(conn->incoming.empty()) return 0;
+                continue;
+            }
+            st.in_arg = false;
+        }
+        else if(st.cmd.size() == st.nstr)
+        {
+            return st.body_left == 0 ? 1 : -1;
+        }
+        else
+        {
+            uint32_t len = 0;
+            if(st.body_left < 4) return -1;
+            if(!stream_u32(conn, len)) return 0;
+            if(len > st.body_left) return -1;
+            st.cmd.emplace_back();
+            st.arg_len = len;
+            st.arg_filled = 0;
+            st.in_arg = len > 0;
+        }
+    }
+}
+
+// IN : Conn *conn, std::vector<std::string> &cmd, uint32_t len
+// OUT : request executed, response queued (or applied silently from a primary)
+// DESC: Run a fully parsed request
+static void conn_dispatch(Conn *conn, std::vector<std::string> &cmd, uint32_t len)
+{
+    if(conn->role == CONN_MASTER)
+    {
+        repl_apply(conn, cmd, len);
+    }
+    else
+    {
+        Response resp;
+        do_request(conn, cmd, resp);
+        if(conn->bitop) return;     // replied when the job finishes
+        make_response(resp, conn);
+    }
+}
+
+// IN : Conn *conn
+// OUT : returns true if a request was processed; updates conn buffers and Response
+// DESC: Try to process one complete request from the connection buffer.
+//       Messages of k_stream_threshold bytes or more are parsed incrementally.
+static bool try_one_request(Conn *conn)
+{
+    ReqStream &st = conn->stream;
+    if(st.active)
+    {
+        int32_t rv = stream_feed(conn);
+        if(rv < 0)
+        {
+            msg("bad request");
+            conn->want_close = true;
+        }
+        if(rv <= 0)
+        {
+            return false;
+        }
+
+        std::vector<std::string> cmd;
+        cmd.swap(st.cmd);
+        uint32_t len = st.len;
+        st = ReqStream {};
+        conn_dispatch(conn, cmd, len);
+        return true;
+    }
+
+    if(conn->incoming.size() < 4)
+    {
+        return false;
+    }
+
+    uint32_t len = 0;
+    memcpy(&len, conn->incoming.data(), 4);
+
+    if(len > k_max_msg)
+    {
+        msg("MSG too long.");
+        conn->want_close = true;
+        return false;
+    }
+
+    bool handshake = conn->role == CONN_MASTER && conn->repl_state == REPL_HANDSHAKE;
+    bool replies = handshake || conn->role == CONN_MIGRATE;
+    if(len >= k_stream_threshold && !replies)
+    {
+        buf_remove(conn->incoming, 4);
+        st.active = true;
+        st.len = len;
+        st.body_left = len;
+        return try_one_request(conn);
+    }
+
+    if(4 + len > conn->incoming.size())
+    {
+        return false;
+    }
+
+    const uint8_t *request = &conn->incoming[4];
+
+    if(handshake)
+    {
+        if(!repl_handshake(conn, request, len))
+        {
+            conn->want_close = true;
+            return false;
+        }
+        buf_remove(conn->incoming, 4 + len);
+        return true;
+    }
+    if(conn->role == CONN_MIGRATE)
+    {
+        if(!migrate_reply(conn, request, len))
+        {
+            conn->want_close = true;
+            return false;
+        }
+        buf_remove(conn->incoming, 4 + len);
+        return true;
+    }
+
+    std::vector<std::string> cmd;
+    if(parse_req(request, len, cmd) < 0)
+    {
+        msg("bad request");
+        conn->want_close = true;
+        return false;
+    }
+
+    buf_remove(conn->incoming, 4 + len);
+    conn_dispatch(conn, cmd, len);
+
+    return true;
+}
+
+// IN : Conn *conn
+// OUT : true if conn->incoming holds at least one complete message
+// DESC: Check whether try_one_request() can make progress
+static bool conn_has_request(Conn *conn)
+{
+    const ReqStream &st = conn->stream;
+    if(st.active)
+    {
+        // every argument filled, e.g. by a direct read in handle_read()
+        if(!st.in_arg && st.have_nstr && st.cmd.size() == st.nstr) return true;
+        return conn->incoming.size() >= (st.in_arg ? 1 : 4);
+    }
+    if(conn->incoming.size() < 4) return false;
+
+    uint32_t len = 0;
+    memcpy(&len, conn->incoming.data(), 4);
+    return len > k_max_msg || 4 + (size_t)len <= conn->incoming.size();
+}
+
+// IN : Conn *conn
+// OUT : intent flags updated, conn queued in g_data.pending if needed
+// DESC: Decide what to wait for next. Reading pauses while complete requests
+//       are queued or the output is above the soft limit; above the hard
+//       limit a client connection is closed. Replication and migration
+//       links bound their own output, see repl_update() and migrate_update().
+static void conn_update_intent(Conn *conn)
+{
+    size_t out = conn_out_size(conn);
+    if(conn->role == CONN_NORMAL && out > g_config.out_hard_limit && !conn->want_close)
+    {
+        msg("Output buffer hard limit reached, closing.");
+        conn->want_close = true;
+    }
+
+    bool throttled = out >= g_config.out_soft_limit;
+    bool blocked = conn->bitop != NULL;
+    bool more = !conn->want_close && !blocked && conn_has_request(conn);
+    if(more && !throttled && !conn->pending)
+    {
+        conn->pending = true;
+        g_data.pending.push_back(conn);
+    }
+
+    conn->want_read = !more && !throttled && !blocked;
+    conn->want_write = out > 0;
+}
+
+// IN : Conn *conn
+// OUT : some requests processed, intent flags updated
+// DESC: Process buffered requests up to the per-iteration request and byte
+//       budgets, so one pipelining client cannot starve the others
+static void conn_process(Conn *conn)
+{
+    size_t nreq = 0;
+    size_t nbytes = 0;
+    while(nreq < k_req_budget && nbytes < k_byte_budget && !conn->bitop
+        && conn_out_size(conn) < g_config.out_soft_limit)
+    {
+        size_t before = conn->incoming.size();
+        if(!try_one_request(conn)) break;
+        nreq++;
+        nbytes += before - conn->incoming.size();
+    }
+    conn_update_intent(conn);
+}
+
+// IN : Conn *conn
+// OUT : updates conn->outgoing buffer and intent flags
+// DESC: Write buffered data to the client socket, private bytes and shared
+//       buffers gathered in stream order with one writev()
+static void handle_write(Conn *conn)
+{
+    struct iovec iov[k_max_iov];
+    size_t niov = 0;
+    size_t priv = 0;        // bytes of conn->outgoing already in iov
+    bool all_refs = true;
+    for(const OutRef &ref : conn->out_refs)
+    {
+        if(niov + 2 > k_max_iov)
+        {
+            all_refs = false;
+            break;
+        }
+        size_t gap = (size_t)(ref.at - conn->out_sent) - priv;
+        if(gap > 0)
+        {
+            iov[niov++] = {&conn->outgoing[priv], gap};
+            priv += gap;
+        }
+        iov[niov++] = {&ref.buf->data[ref.pos], ref.buf->data.size() - ref.pos};
+    }
+    if(all_refs && priv < conn->outgoing.size())
+    {
+        iov[niov++] = {&conn->outgoing[priv], conn->outgoing.size() - priv};
+    }
+
+    if(niov == 0)
+    {
+        conn_update_intent(conn);
+        return;
+    }
+
+    ssize_t rv = writev(conn->fd, iov, (int)niov);
+    if(rv < 0 && errno == EAGAIN)
+    {
+        return;
+    }
+    if(rv < 0)
     {
         msg_errno("write error");
         conn->want_close = true;
         return;
     }
 
-    buf_remove(conn->outgoing, (size_t)rv);
+    conn_out_consume(conn, (size_t)rv);
+    conn_update_intent(conn);
+}
+
+// IN : Conn *conn
+// OUT : updates conn->incoming buffer and intent flags
+// DESC: Read data from the client socket, append to buffer (or to the streamed
+//       argument being filled), and process requests
+static void handle_read(Conn *conn)
+{
+    uint8_t buf[64 * 1024];
+    uint8_t *dst = buf;
+    size_t cap = sizeof(buf);
+
+    // While a streamed argument is being filled, read straight into it.
+    ReqStream &st = conn->stream;
+    bool direct = st.active && st.in_arg && conn->incoming.empty()
+        && st.arg_filled < st.arg_len;
+    if(direct)
+    {
+        std::string &arg = stream_grow(st);
+        dst = (uint8_t *)&arg[st.arg_filled];
+        cap = arg.size() - st.arg_filled;
+    }
+
+    ssize_t rv = read(conn->fd, dst, cap);
+    if(rv < 0 && errno == EAGAIN)
+    {
+        return;
+    }
+
+    if(rv < 0)
+    {
+        msg_errno("read() error");
+        conn->want_close = true;
+        return;
+    }
+
+    if(rv == 0)
+    {
+        if(conn->incoming.size() == 0 && !st.active)
+        {
+            msg("Client closed.");
+        } else {
+            msg("Unexpected EOF.");
+        }
+        conn->want_close = true;
+        return;
+    }
+
+    if(direct)
+    {
+        st.arg_filled += (size_t)rv;
+        st.body_left -= (uint32_t)rv;
+        if(st.arg_filled == st.arg_len)
+        {
+            st.in_arg = false;  // the request may be complete with nothing buffered
+        }
+    }
+    else
+    {
+        buf_append(conn->incoming, buf, (size_t)rv);
+    }
+
+    conn_process(conn);
+
+    if(conn_out_size(conn) > 0 && !conn->want_close)
+    {
+        return handle_write(conn);
+    }
+}
+
+// IN : Conn *conn
+// OUT : conn stored in g_data.fd2conn
+// DESC: Register a connection with the event loop
+static void conn_register(Conn *conn)
+{
+    if(g_data.fd2conn.size() <= (size_t)conn->fd)
+    {
+        g_data.fd2conn.resize(conn->fd + 1);
+    }
+    assert(!g_data.fd2conn[conn->fd]);
+    g_data.fd2conn[conn->fd] = conn;
+}
+
+// IN : Conn *conn
+// OUT : socket closed, conn freed
+// DESC: Close a connection and drop its subscriptions and replication state
+static void conn_destroy(Conn *conn)
+{
+    (void)close(conn->fd);
+    g_data.fd2conn[conn->fd] = NULL;
+
+    while(!conn->channels.empty())
+    {
+        channel_unsubscribe(conn, conn->channels.size() - 1);
+    }
+    while(!conn->patterns.empty())
+    {
+        pattern_unsubscribe(conn, conn->patterns.size() - 1);
+    }
+    if(conn->tracking == TRACK_BCAST)
+    {
+        vec_erase(g_track.bcast, conn);
+    }
+    if(conn->bitop)
+    {
+        vec_erase(g_bitop.jobs, conn->bitop);
+        delete conn->bitop;
+    }
+    if(conn->import_slot >= 0 && g_cluster.owner[conn->import_slot] != 0
+        && g_cluster.importing[conn->import_slot] != k_no_node)
+    {
+        // the source's migration link: the source aborted, stop importing
+        fprintf(stderr, "Import of slot %d abandoned.\n", conn->import_slot);
+        g_cluster.importing[conn->import_slot] = k_no_node;
+    }
+    for(OutRef &ref : conn->out_refs)
+    {
+        rcbuf_unref(ref.buf);
+    }
+    if(conn->pending)
+    {
+        std::deque<Conn *> &q = g_data.pending;
+        for(size_t i = 0 ; i < q.size() ; ++i)
+        {
+            if(q[i] == conn)
+            {
+                q.erase(q.begin() + i);
+                break;
+            }
+        }
+    }
+
+    if(conn->role == CONN_REPLICA)
+    {
+        msg("Replica detached.");
+        hm_iter_release(&conn->snapshot);
+        std::vector<Conn *> &list = g_repl.replicas;
+        for(size_t i = 0 ; i < list.size() ; ++i)
+        {
+            if(list[i] == conn)
+            {
+                list.erase(list.begin() + i);
+                break;
+            }
+        }
+    }
+    else if(conn->role == CONN_MASTER)
+    {
+        msg("Lost link to primary.");
+        g_repl.master = NULL;
+        g_repl.next_connect_ms = get_monotonic_msec() + k_repl_retry_ms;
+    }
+    else if(conn->role == CONN_MIGRATE)
+    {
+        // The slot goes back to stable here, and the target drops "importing"
+        // when it sees the link close, so neither side redirects to the other.
+        // Keys the target already took stay there until "cluster migrate"
+        // resumes; keys in flight and writes made until then are sent again
+        // as dirty.
+        if(g_migrate.active)
+        {
+            g_cluster.migrating[g_migrate.slot] = k_no_node;
+            if(g_migrate.linked)
+            {
+                fprintf(stderr, "Migration of slot %u aborted, %llu keys left on %s.\n",
+                        g_migrate.slot, (unsigned long long)g_migrate.moved,
+                        g_cluster.nodes[g_migrate.target].c_str());
+                g_migrate.aborted = true;
+            }
+            else
+            {
+                fprintf(stderr, "Migration of slot %u failed, no link to %s.\n",
+                        g_migrate.slot, g_cluster.nodes[g_migrate.target].c_str());
+            }
+        }
+        if(g_migrate.scanning)
+        {
+            hm_iter_release(&g_migrate.iter);
+        }
+        g_migrate.active = false;
+        g_migrate.link = NULL;
+        g_migrate.scanning = false;
+        g_migrate.finishing = false;
+        g_migrate.ops.clear();
+        for(const std::pair<const std::string, uint32_t> &it : g_migrate.inflight)
+        {
+            g_migrate.dirty.insert(it.first);
+        }
+        g_migrate.inflight.clear();
+    }
+
+    delete conn;
+}
+
+// IN : HNode *node, void *arg
+// OUT : a set request for the entry appended to the replica's outgoing buffer
+// DESC: Snapshot iterator callback
+static void repl_snapshot_cb(HNode *node, void *arg)
+{
+    Conn *conn = (Conn *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    uint32_t size = (uint32_t)entry_raw_size(ent);
+
+    // values go out uncompressed, the replica applies its own settings
+    std::vector<uint8_t> &out = conn->outgoing;
+    buf_append_u32(out, 4 + 4 + 3 + 4 + (uint32_t)ent->key.size() + 4 + size);
+    buf_append_u32(out, 3);
+    buf_append_str(out, "set");
+    buf_append_str(out, ent->key);
+    buf_append_u32(out, size);
+    size_t pos = out.size();
+    out.resize(pos + size);
+    entry_read(ent, &out[pos]);
+}
 
-    if(conn->outgoing.size() == 0)
+// IN : none
+// OUT : replica outgoing buffers refilled, lagging replicas dropped
+// DESC: Called once per loop iteration. Streams snapshots a chunk at a time,
+//       then releases the stream held in repl_buf behind them.
+static void repl_update()
+{
+    for(size_t i = g_repl.replicas.size() ; i-- > 0 ;)
     {
-        conn->want_read = true;
-        conn->want_write = false;
+        Conn *conn = g_repl.replicas[i];
+
+        if(conn_out_size(conn) + conn->repl_buf.size() > k_repl_out_limit)
+        {
+            msg("Replica output buffer limit reached, dropping.");
+            conn_destroy(conn);
+            continue;
+        }
+
+        if(conn->repl_state == REPL_SNAPSHOT)
+        {
+            // The open cursor pauses resizing of the db, so a replica that
+            // stops reading must not hold it forever.
+            uint64_t now_ms = get_monotonic_msec();
+            if(conn->outgoing.size() >= k_repl_chunk)
+            {
+                if(now_ms - conn->snapshot_ms > k_repl_stall_ms)
+                {
+                    msg("Replica stalled during full sync, dropping.");
+                    conn_destroy(conn);
+                    continue;
+                }
+            }
+            else
+            {
+                conn->snapshot_ms = now_ms;
+            }
+            while(conn->outgoing.size() < k_repl_chunk)
+            {
+                if(!hm_iter_next(&conn->snapshot, k_repl_snapshot_work, &repl_snapshot_cb, conn))
+                {
+                    hm_iter_release(&conn->snapshot);
+                    buf_append_cmd(conn->outgoing, {"syncdone"});
+                    conn->repl_state = REPL_ONLINE;
+                    break;
+                }
+            }
+        }
+
+        // from here on repl_feed() appends to outgoing directly
+        if(conn->repl_state == REPL_ONLINE && !conn->repl_buf.empty())
+        {
+            if(conn->outgoing.empty())
+            {
+                conn->outgoing.swap(conn->repl_buf);
+            }
+            else
+            {
+                buf_append(conn->outgoing, conn->repl_buf.data(), conn->repl_buf.size());
+            }
+            std::vector<uint8_t>().swap(conn->repl_buf);
+        }
+
+        if(conn_out_size(conn) > 0)
+        {
+            conn->want_read = false;
+            conn->want_write = true;
+        }
     }
 }
 
-// IN : Conn *conn
-// OUT : updates conn->incoming buffer and intent flags
-// DESC: Read data from the client socket, append to buffer, and process requests
-static void handle_read(Conn *conn)
+// IN : none
+// OUT : g_repl.master set on success, a retry scheduled on failure
+// DESC: Open a non-blocking link to the primary and queue the sync request
+static void repl_connect()
 {
-    uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
-    if(rv < 0 && errno == EAGAIN)
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
     {
+        die("socket()");
+    }
+    fd_set_nb(fd);
+    fd_set_sockopts(fd, true);
+
+    int rv = connect(fd, (const struct sockaddr *)&g_repl.master_addr, sizeof(g_repl.master_addr));
+    if(rv < 0 && errno != EINPROGRESS)
+    {
+        msg_errno("connect() to primary");
+        (void)close(fd);
+        g_repl.next_connect_ms = get_monotonic_msec() + k_repl_retry_ms;
         return;
     }
 
-    if(rv < 0)
+    Conn *conn = new Conn();
+    conn->fd = fd;
+    conn->role = CONN_MASTER;
+    conn->repl_state = REPL_HANDSHAKE;
+    conn->want_write = true;
+    buf_append_cmd(conn->outgoing,
+        {"sync", g_repl.master_replid, std::to_string(g_repl.master_offset)});
+    conn_register(conn);
+    g_repl.master = conn;
+}
+
+// IN : HNode *node, void *arg
+// OUT : the entry queued on the migration link if it is in the migrating slot
+// DESC: Migration iterator callback
+static void migrate_cb(HNode *node, void *)
+{
+    Entry *ent = container_of(node, Entry, node);
+    if(ent->slot != g_migrate.slot || g_migrate.inflight.count(ent->key)) return;
+    migrate_send_key(ent->key);
+}
+
+// IN : none
+// OUT : g_migrate.link set on success, the migration dropped on failure
+// DESC: Open a non-blocking link to the importing node and queue the setup
+static void migrate_connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
     {
-        msg_errno("read() error");
-        conn->want_close = true;
+        die("socket()");
+    }
+    fd_set_nb(fd);
+    fd_set_sockopts(fd, true);
+
+    int rv = connect(fd, (const struct sockaddr *)&g_migrate.addr, sizeof(g_migrate.addr));
+    if(rv < 0 && errno != EINPROGRESS)
+    {
+        msg_errno("connect() to importing node");
+        (void)close(fd);
+        fprintf(stderr, "Migration of slot %u failed.\n", g_migrate.slot);
+        g_cluster.migrating[g_migrate.slot] = k_no_node;
+        g_migrate.active = false;
         return;
     }
 
-    if(rv == 0)
+    Conn *conn = new Conn();
+    conn->fd = fd;
+    conn->role = CONN_MIGRATE;
+    conn->want_read = true;
+    buf_append_cmd(conn->outgoing,
+        {"cluster", "setslot", std::to_string(g_migrate.slot), "importing", g_cluster.nodes[0], "link"});
+    g_migrate.ops.push_back(MigrateOp {MIG_SETUP, std::string()});
+    conn_register(conn);
+    g_migrate.link = conn;
+
+    hm_iter_init(&g_data.db, &g_migrate.iter);
+    g_migrate.scanning = true;
+    fprintf(stderr, "Migrating slot %u to %s\n", g_migrate.slot,
+            g_cluster.nodes[g_migrate.target].c_str());
+}
+
+// IN : none
+// OUT : more keys of the migrating slot queued on the link
+// DESC: Called once per loop iteration. Re-sends dirty keys, then scans the
+//       db a step at a time while fewer than k_migrate_window keys are in
+//       flight. Once every key is acknowledged the slot is handed over.
+static void migrate_update()
+{
+    if(!g_migrate.active) return;
+    if(!g_migrate.link)
+    {
+        migrate_connect();
+        if(!g_migrate.link) return;
+    }
+
+    Conn *conn = g_migrate.link;
+    if(conn->want_close) return;
+
+    for(const std::string &key : g_migrate.dirty)
+    {
+        migrate_send_key(key);
+    }
+    g_migrate.dirty.clear();
+
+    while(g_migrate.scanning && g_migrate.inflight.size() < k_migrate_window
+        && conn->outgoing.size() < k_repl_chunk)
     {
-        if(conn->incoming.size() == 0)
+        if(!hm_iter_next(&g_migrate.iter, k_repl_snapshot_work, &migrate_cb, NULL))
         {
-            msg("Client closed.");
-        } else {
-            msg("Unexpected EOF.");
+            hm_iter_release(&g_migrate.iter);
+            g_migrate.scanning = false;
         }
-        conn->want_close = true;
-        return;
     }
 
-    buf_append(conn->incoming, buf, (size_t)rv);
-
-    while(try_one_request(conn)) {}
+    if(!g_migrate.scanning && !g_migrate.finishing && g_migrate.ops.empty())
+    {
+        if(g_cluster.keys[g_migrate.slot] > 0)
+        {
+            // a key the scan did not see is still here, go over the db again
+            hm_iter_init(&g_data.db, &g_migrate.iter);
+            g_migrate.scanning = true;
+        }
+        else
+        {
+            buf_append_cmd(conn->outgoing,
+                {"cluster", "setslot", std::to_string(g_migrate.slot), "node",
+                 g_cluster.nodes[g_migrate.target]});
+            g_migrate.ops.push_back(MigrateOp {MIG_FINISH, std::string()});
+            g_migrate.finishing = true;
+        }
+    }
 
-    if(conn->outgoing.size() > 0)
+    if(conn_out_size(conn) > 0)
     {
-        conn->want_read = false;
         conn->want_write = true;
-        return handle_write(conn);
     }
 }
 
-/*
-//////////////////////////////////
-MAIN LOGIC
-//////////////////////////////////
-*/
+// IN : none
+// OUT : g_repl.replid set
+// DESC: Pick a random replication id for this process's stream
+static void repl_init()
+{
+    uint8_t raw[20] = {};
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd < 0 || read(fd, raw, sizeof(raw)) != (ssize_t)sizeof(raw))
+    {
+        srand((unsigned)time(NULL) ^ (unsigned)getpid());
+        for(uint8_t &b : raw) b = (uint8_t)rand();
+    }
+    if(fd >= 0) (void)close(fd);
+
+    for(size_t i = 0 ; i < sizeof(raw) ; ++i)
+    {
+        snprintf(&g_repl.replid[i * 2], 3, "%02x", raw[i]);
+    }
+}
+
+// IN : none
+// OUT : every running bitop advanced by one step; finished ones replied
+// DESC: Bounded bitop work per loop iteration. A job restarted by writes
+//       k_bitop_max_restarts times runs to completion, so it cannot starve.
+static void bitop_update()
+{
+    std::vector<BitopJob *> jobs = g_bitop.jobs;
+    for(BitopJob *job : jobs)
+    {
+        if(job->restart)
+        {
+            job->restarts++;
+            g_bitop.restarts++;
+            bitop_load(job);
+        }
+        bitop_run(job, job->restarts >= k_bitop_max_restarts ? job->len : k_bitop_step);
+        if(job->result.size() < job->len) continue;
+
+        Conn *conn = job->conn;
+        vec_erase(g_bitop.jobs, job);
+        conn->bitop = NULL;
+        Response resp;
+        bitop_store(job, resp);
+        make_response(resp, conn);
+        delete job;
+        conn_update_intent(conn);
+    }
+}
+
+// IN : none
+// OUT : true if a table has a migration the idle loop can advance
+// DESC: Keeps poll() from blocking while rehashing work is left
+static bool rehash_pending()
+{
+    return hm_rehashing(&g_data.db) || hm_rehashing(&g_data.channels);
+}
+
+// IN : none
+// OUT : db and channel tables migrated for up to k_idle_rehash_ns
+// DESC: Finish resizes while there is no traffic, instead of only
+//       piggy-backing on later requests
+static void idle_rehash()
+{
+    uint64_t start = get_monotonic_nsec();
+    while(get_monotonic_nsec() - start < k_idle_rehash_ns)
+    {
+        bool more = hm_rehash_step(&g_data.db, k_idle_rehash_work);
+        more = hm_rehash_step(&g_data.channels, k_idle_rehash_work) || more;
+        if(!more) break;
+    }
+}
+
+// IN : uint16_t port, const std::vector<std::string> &assign
+// OUT : g_cluster initialized; returns false on a bad assignment
+// DESC: Set up cluster mode. assign holds "host:port" / "ranges" pairs from
+//       --cluster-node, ranges being "a-b" or single slots separated by commas.
+static bool cluster_init(uint16_t port, const std::vector<std::string> &assign)
+{
+    for(uint32_t i = 0 ; i < k_cluster_slots ; ++i)
+    {
+        g_cluster.owner[i] = k_no_node;
+        g_cluster.migrating[i] = k_no_node;
+        g_cluster.importing[i] = k_no_node;
+    }
+    g_cluster.nodes.push_back(g_cluster.announce_host + ":" + std::to_string(port));
+
+    for(size_t i = 0 ; i + 1 < assign.size() ; i += 2)
+    {
+        struct sockaddr_in addr;
+        if(!parse_addr(assign[i], addr)) return false;
+        uint16_t node = cluster_node(assign[i]);
+
+        const char *p = assign[i + 1].c_str();
+        while(*p)
+        {
+            char *end = NULL;
+            unsigned long lo = strtoul(p, &end, 10);
+            unsigned long hi = lo;
+            if(end == p) return false;
+            if(*end == '-')
+            {
+                p = end + 1;
+                hi = strtoul(p, &end, 10);
+                if(end == p) return false;
+            }
+            if(lo > hi || hi >= k_cluster_slots) return false;
+            for(unsigned long s = lo ; s <= hi ; ++s)
+            {
+                g_cluster.owner[s] = node;
+            }
+            if(*end == ',') end++;
+            else if(*end) return false;
+            p = end;
+        }
+    }
+    return true;
+}
 
-int main()
+// IN : uint16_t port
+// OUT : non-blocking listening socket on 0.0.0.0:port
+// DESC: Open the TCP listener
+static int listen_tcp(uint16_t port)
 {
     //Socket syscall takes in 3 args.
     //1. Address Family (AF_INET for IPv4)
@@ -469,15 +3548,25 @@ int main()
     // Setting Socket Options
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    // accepted sockets inherit the buffer sizes; set them before listen()
+    // so the window scale offered in the handshake matches
+    if(g_config.sndbuf > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &g_config.sndbuf, sizeof(int));
+    }
+    if(g_config.rcvbuf > 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &g_config.rcvbuf, sizeof(int));
+    }
 
 
     //Binding to an Address
-    //Binding to 0.0.0.0:8080
+    //Binding to 0.0.0.0:port (8080 unless --port is given)
     // struct sockaddr_in holds an IPv4:port pair stored as big-endian numbers, 
     // converted by htons() and htonl(). For example, 1.2.3.4 is represented by htonl(0x01020304).
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(8080); // Port 8080
+    addr.sin_port = htons(port);
     addr.sin_addr.s_addr = htonl(0); // Wildcard IP 0.0.0.0
     int rv = bind(fd, (const struct sockaddr *) &addr, sizeof(addr));
     if(rv) 
@@ -489,30 +3578,240 @@ int main()
     fd_set_nb(fd);
 
     // Listening for Connections
-    rv = listen(fd, SOMAXCONN); // SOMAXCONN is the maximum length for the queue of pending connections.
+    // the backlog is the maximum length of the queue of pending connections,
+    // SOMAXCONN unless --listen-backlog is given
+    rv = listen(fd, g_config.listen_backlog);
     if(rv) 
     {
         die("listen()");
     }
+    return fd;
+}
 
-    // Map of all client connections, keyed by the fd.
-    std::vector<Conn *> fd2conn;
+// IN : const char *path, const char *perm
+// OUT : non-blocking listening socket bound to path
+// DESC: Open the Unix domain socket listener. A stale socket file left by a
+//       previous run is removed first; perm is an octal mode or NULL.
+static int listen_unix(const char *path, const char *perm)
+{
+    struct sockaddr_un addr = {};
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        die("unix socket path too long");
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        die("socket()");
+    }
+
+    (void)unlink(path);
+    if(bind(fd, (const struct sockaddr *)&addr, sizeof(addr)))
+    {
+        die("bind() unix socket");
+    }
+    if(perm && chmod(path, (mode_t)strtoul(perm, NULL, 8)))
+    {
+        die("chmod() unix socket");
+    }
+
+    fd_set_nb(fd);
+    if(listen(fd, g_config.listen_backlog))
+    {
+        die("listen()");
+    }
+    return fd;
+}
+
+// IN : const char *prog
+// OUT : none, exits
+// DESC: Print command line usage
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [--port N] [--replicaof HOST PORT] [--repl-backlog BYTES]\n"
+        "          [--out-soft-limit BYTES] [--out-hard-limit BYTES]\n"
+        "          [--compress-min BYTES]\n"
+        "          [--cluster] [--cluster-announce HOST] [--cluster-node HOST:PORT SLOTS]...\n"
+        "          [--unixsocket PATH] [--unixsocket-perm OCTAL] [--listen-backlog N]\n"
+        "          [--busy-poll USEC] [--sndbuf BYTES] [--rcvbuf BYTES]\n"
+        "          [--tracking-table-max N]\n", prog);
+    exit(1);
+}
+
+/*
+//////////////////////////////////
+MAIN LOGIC
+//////////////////////////////////
+*/
+
+int main(int argc, char **argv)
+{
+    uint16_t port = 8080;
+    const char *unix_path = NULL;
+    const char *unix_perm = NULL;
+    std::vector<std::string> cluster_assign;
+    for(int i = 1 ; i < argc ; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "--port" && i + 1 < argc)
+        {
+            port = (uint16_t)atoi(argv[++i]);
+        }
+        else if(arg == "--replicaof" && i + 2 < argc)
+        {
+            g_repl.is_replica = true;
+            g_repl.master_addr.sin_family = AF_INET;
+            g_repl.master_addr.sin_port = htons((uint16_t)atoi(argv[i + 2]));
+            if(inet_pton(AF_INET, argv[i + 1], &g_repl.master_addr.sin_addr) != 1)
+            {
+                usage(argv[0]);
+            }
+            i += 2;
+        }
+        else if(arg == "--repl-backlog" && i + 1 < argc)
+        {
+            g_repl.backlog_cap = strtoull(argv[++i], NULL, 10);
+            if(g_repl.backlog_cap == 0) usage(argv[0]);
+        }
+        else if(arg == "--out-soft-limit" && i + 1 < argc)
+        {
+            g_config.out_soft_limit = strtoull(argv[++i], NULL, 10);
+        }
+        else if(arg == "--out-hard-limit" && i + 1 < argc)
+        {
+            g_config.out_hard_limit = strtoull(argv[++i], NULL, 10);
+        }
+        else if(arg == "--compress-min" && i + 1 < argc)
+        {
+            g_config.compress_min = strtoull(argv[++i], NULL, 10);
+        }
+        else if(arg == "--unixsocket" && i + 1 < argc)
+        {
+            unix_path = argv[++i];
+        }
+        else if(arg == "--unixsocket-perm" && i + 1 < argc)
+        {
+            unix_perm = argv[++i];
+        }
+        else if(arg == "--listen-backlog" && i + 1 < argc)
+        {
+            g_config.listen_backlog = atoi(argv[++i]);
+        }
+        else if(arg == "--busy-poll" && i + 1 < argc)
+        {
+            g_config.busy_poll_usec = atoi(argv[++i]);
+        }
+        else if(arg == "--sndbuf" && i + 1 < argc)
+        {
+            g_config.sndbuf = atoi(argv[++i]);
+        }
+        else if(arg == "--rcvbuf" && i + 1 < argc)
+        {
+            g_config.rcvbuf = atoi(argv[++i]);
+        }
+        else if(arg == "--tracking-table-max" && i + 1 < argc)
+        {
+            g_config.tracking_max = strtoull(argv[++i], NULL, 10);
+            if(g_config.tracking_max == 0) usage(argv[0]);
+        }
+        else if(arg == "--cluster")
+        {
+            g_cluster.enabled = true;
+        }
+        else if(arg == "--cluster-announce" && i + 1 < argc)
+        {
+            g_cluster.announce_host = argv[++i];
+        }
+        else if(arg == "--cluster-node" && i + 2 < argc)
+        {
+            g_cluster.enabled = true;
+            cluster_assign.push_back(argv[i + 1]);
+            cluster_assign.push_back(argv[i + 2]);
+            i += 2;
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+
+    // Writing to a peer that went away must fail with EPIPE, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+    repl_init();
+    if(g_cluster.enabled && !cluster_init(port, cluster_assign))
+    {
+        usage(argv[0]);
+    }
+
+    // listening sockets: TCP unless --port 0, plus the optional unix socket
+    std::vector<int> listeners;
+    if(port)
+    {
+        listeners.push_back(listen_tcp(port));
+    }
+    if(unix_path)
+    {
+        listeners.push_back(listen_unix(unix_path, unix_perm));
+    }
+    if(listeners.empty())
+    {
+        usage(argv[0]);
+    }
+
+    std::vector<Conn *> &fd2conn = g_data.fd2conn;
 
     std::vector<struct pollfd> poll_args;
 
     // Event loop
     while(true)
     {
+        // replication: (re)connect to the primary, feed attached replicas;
+        // cluster: feed the slot migration link
+        int timeout_ms = -1;
+        if(g_repl.is_replica && !g_repl.master)
+        {
+            uint64_t now_ms = get_monotonic_msec();
+            if(now_ms >= g_repl.next_connect_ms)
+            {
+                repl_connect();
+            }
+            if(!g_repl.master)
+            {
+                timeout_ms = (int)(g_repl.next_connect_ms - get_monotonic_msec());
+                if(timeout_ms < 0) timeout_ms = 0;
+            }
+        }
+        repl_update();
+        migrate_update();
+        bitop_update();
+        if(!g_data.pending.empty() || rehash_pending() || !g_bitop.jobs.empty())
+        {
+            timeout_ms = 0;
+        }
+
         //prepare args of poll(), move the listening sockets to first position.
         poll_args.clear();
 
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
+        for(int lfd : listeners)
+        {
+            struct pollfd pfd = {lfd, POLLIN, 0};
+            poll_args.push_back(pfd);
+        }
 
         // connection sockets
         for(Conn *conn : fd2conn)
         {
             if(!conn) continue;
+            // closed outside of its own IO, e.g. a subscriber over the output limit
+            if(conn->want_close)
+            {
+                conn_destroy(conn);
+                continue;
+            }
             
             //poll() for error, then poll() flags from the apps intent.
             struct pollfd pfd = {conn->fd, POLLERR, 0};
@@ -529,7 +3828,7 @@ int main()
         }
 
         // wait for readiness
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), -1);
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
         if(rv < 0 && errno == EINTR)
         {
             continue;
@@ -538,24 +3837,24 @@ int main()
         {
             die("poll");
         }
+        if(rv == 0 && g_data.pending.empty())
+        {
+            idle_rehash();
+        }
 
-        // Handle listening socket.
-        if(poll_args[0].revents)
+        // Handle listening sockets.
+        for(size_t i = 0 ; i < listeners.size() ; ++i)
         {
-            if(Conn *conn = handle_accept(fd))
+            if(!poll_args[i].revents) continue;
+            if(Conn *conn = handle_accept(listeners[i]))
             {
                 // put conn into the map.
-                if(fd2conn.size() <= (size_t)conn->fd)
-                {
-                    fd2conn.resize(conn->fd + 1);
-                }
-                assert(!fd2conn[conn->fd]);
-                fd2conn[conn->fd] = conn;
+                conn_register(conn);
             }
         }
 
         // Handle connection sockets
-        for(size_t i = 1 ; i < poll_args.size() ; ++i) //skip first
+        for(size_t i = listeners.size() ; i < poll_args.size() ; ++i) //skip listeners
         {
             uint32_t ready = poll_args[i].revents;
             if(ready == 0) continue;
@@ -567,21 +3866,33 @@ int main()
                 handle_read(conn);
             }
 
-            if(ready & POLLOUT)
+            // handle_read() may already have flushed everything
+            if((ready & POLLOUT) && conn->want_write)
             {
-                assert(conn ->want_write);
                 handle_write(conn);
             }
 
             //Close socket from socket err or from app logic
             if((ready & POLLERR) || conn->want_close)
             {
-                (void)close(conn->fd);
-                fd2conn[conn->fd] = NULL;
-                delete conn;
+                conn_destroy(conn);
             }
         } // for each connection socket
 
+        // Resume connections that ran out of budget, one budget each.
+        for(size_t n = g_data.pending.size() ; n > 0 && !g_data.pending.empty() ; --n)
+        {
+            Conn *conn = g_data.pending.front();
+            g_data.pending.pop_front();
+            conn->pending = false;
+
+            conn_process(conn);
+            if(conn_out_size(conn) > 0 && !conn->want_close)
+            {
+                handle_write(conn);
+            }
+        }
+
     }   // the event loop
     return 0;
 }
\ No newline at end of file